@@ -27,6 +27,10 @@ nm_action_result_t *nm_action_result_msg(const char *fmt, ...) __attribute__((fo
 nm_action_result_t *nm_action_result_toast(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
 void nm_action_result_free(nm_action_result_t *res);
 
+// nm_action_name returns the name of an action (as used in the config), or
+// NULL if it isn't known.
+const char *nm_action_name(nm_action_fn_t act);
+
 #define NM_ACTION(name) nm_action_##name
 
 #ifdef __cplusplus
@@ -42,6 +46,10 @@ void nm_action_result_free(nm_action_result_t *res);
     X(dbg_error)          \
     X(dbg_msg)            \
     X(dbg_toast)          \
+    X(dbg_generators)     \
+    X(dbg_trace)          \
+    X(dbg_stats)          \
+    X(dbg_stalls)         \
     X(kfmon)              \
     X(kfmon_id)           \
     X(nickel_setting)     \
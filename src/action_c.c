@@ -2,14 +2,28 @@
 #include <fcntl.h>
 #include <limits.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
 #include "action.h"
+#include "config.h"
+#include "generator.h"
 #include "kfmon.h"
+#include "stall.h"
+#include "stats.h"
+#include "trace.h"
 #include "util.h"
 
+const char *nm_action_name(nm_action_fn_t act) {
+    #define X(name) \
+    if (act == NM_ACTION(name)) return #name;
+    NM_ACTIONS
+    #undef X
+    return NULL;
+}
+
 NM_ACTION_(dbg_syslog) {
     NM_LOG("dbgsyslog: %s", arg);
     return nm_action_result_silent();
@@ -28,6 +42,74 @@ NM_ACTION_(dbg_toast) {
     return nm_action_result_toast("%s", arg);
 }
 
+NM_ACTION_(dbg_generators) {
+    (void) arg;
+
+    size_t n;
+    nm_generator_t **gens = nm_global_config_generators(&n);
+    NM_CHECK(NULL, gens || !n, "could not allocate memory");
+
+    if (!n) {
+        free(gens);
+        return nm_action_result_msg("No generators are configured.");
+    }
+
+    char *msg = NULL;
+    size_t msg_sz = 0;
+    FILE *f = open_memstream(&msg, &msg_sz);
+    if (!f) {
+        free(gens);
+        NM_ERR_RET(NULL, "could not allocate memory: %m");
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        char *str = nm_generator_health_str(gens[i]);
+        NM_LOG("dbg_generators: %s", str ? str : "(error)");
+        fprintf(f, "%s%s", i ? "<br><br>" : "", str ? str : "(error)");
+        free(str);
+    }
+
+    fclose(f);
+    free(gens);
+
+    nm_action_result_t *res = nm_action_result_msg("%s", msg);
+    free(msg);
+    return res;
+}
+
+NM_ACTION_(dbg_trace) {
+    int n = nm_trace_dump(arg);
+    NM_CHECK(NULL, n != -1, "could not write trace: %s", nm_err());
+    return nm_action_result_toast("Wrote %d trace events to %s.", n, arg);
+}
+
+NM_ACTION_(dbg_stats) {
+    if (*arg)
+        NM_CHECK(NULL, nm_stats_dump(arg), "could not write stats: %s", nm_err());
+
+    char *str = nm_stats_summary();
+    NM_CHECK(NULL, str, "could not get stats: %s", nm_err());
+    NM_LOG("dbg_stats: %s", str);
+
+    nm_action_result_t *res = *arg
+        ? nm_action_result_msg("%s<br><br>Wrote stats to %s.", str, arg)
+        : nm_action_result_msg("%s", str);
+    free(str);
+    return res;
+}
+
+NM_ACTION_(dbg_stalls) {
+    (void) arg;
+
+    char *str = nm_stall_summary();
+    NM_CHECK(NULL, str, "could not get stalls: %s", nm_err());
+    NM_LOG("dbg_stalls: %s", str);
+
+    nm_action_result_t *res = nm_action_result_msg("%s", str);
+    free(str);
+    return res;
+}
+
 NM_ACTION_(skip) {
     char *tmp;
     long n = strtol(arg, &tmp, 10);
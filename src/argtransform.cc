@@ -0,0 +1,190 @@
+#include <QByteArray>
+#include <QChar>
+#include <QString>
+#include <QUrl>
+
+#include <cstring>
+
+#include "argtransform.h"
+#include "util.h"
+
+// nm_argtemplate_space matches the same characters as \s in a QRegularExpression
+// (which doesn't use Unicode properties by default).
+static inline bool nm_argtemplate_space(QChar c) {
+    ushort u = c.unicode();
+    return u == ' ' || (u >= '\t' && u <= '\r');
+}
+
+static inline bool nm_argtemplate_alnum(QChar c) {
+    ushort u = c.unicode();
+    return (u >= '0' && u <= '9') || (u >= 'a' && u <= 'z') || (u >= 'A' && u <= 'Z');
+}
+
+// nm_argtemplate_match checks if a substitution starts at i, and returns its
+// length, or 0 if it doesn't.
+static int nm_argtemplate_match(QString const& src, int i, nm_argtemplate_op_t *op) {
+    const QChar *s = src.constData();
+    int n = src.size(), j = i;
+
+    if (j+2 >= n || s[j] != QLatin1Char('{') || s[j+2] != QLatin1Char('|'))
+        return 0;
+    switch (s[j+1].unicode()) {
+    #define X(num, name) \
+    case '0' + num: op->var = NM_ARGTEMPLATE_VAR(name); break;
+    NM_ARGTEMPLATE_VARS
+    #undef X
+    default: return 0;
+    }
+    j += 3;
+
+    int m = j;
+    while (j < n && s[j].unicode() && s[j].unicode() < 0x80 && strchr("aAfnsSuwx", s[j].toLatin1()))
+        j++;
+    int m_len = j - m;
+
+    if (j >= n || s[j] != QLatin1Char('|'))
+        return 0;
+    j++;
+
+    int e = j;
+    while (j < n && s[j].unicode() && s[j].unicode() < 0x80 && strchr("\"$%", s[j].toLatin1()))
+        j++;
+    int e_len = j - e;
+
+    if (j >= n || s[j] != QLatin1Char('}'))
+        return 0;
+    j++;
+
+    op->mods    = src.mid(m, m_len).toLatin1();
+    op->escapes = src.mid(e, e_len).toLatin1();
+    return j - i;
+}
+
+void nm_argtemplate_parse(const char *arg, nm_argtemplate_t *out) {
+    out->src = QString::fromUtf8(arg);
+    out->ops.clear();
+
+    int lit = 0;
+    for (int i = 0; i < out->src.size(); i++) {
+        if (out->src.at(i) != QLatin1Char('{'))
+            continue;
+
+        nm_argtemplate_op_t op = {};
+        int len = nm_argtemplate_match(out->src, i, &op);
+        if (!len)
+            continue;
+
+        op.lit_start  = lit;
+        op.lit_len    = i - lit;
+        op.spec_start = i;
+        op.spec_len   = len;
+        out->ops.append(op);
+
+        lit = i + len;
+        i = lit - 1;
+    }
+
+    if (lit < out->src.size()) {
+        nm_argtemplate_op_t op = {};
+        op.lit_start = lit;
+        op.lit_len   = out->src.size() - lit;
+        out->ops.append(op);
+    }
+}
+
+bool nm_argtemplate_static(const char *arg) {
+    nm_argtemplate_t tmpl;
+    nm_argtemplate_parse(arg, &tmpl);
+    for (const nm_argtemplate_op_t &op : tmpl.ops)
+        if (op.var)
+            return false;
+    return true;
+}
+
+char *nm_argtemplate_apply(const nm_argtemplate_t *tmpl, nm_argtemplate_resolve_t resolve, void *ctx) {
+    QString res;
+    for (const nm_argtemplate_op_t &op : tmpl->ops) {
+        res += tmpl->src.midRef(op.lit_start, op.lit_len);
+        if (!op.var)
+            continue;
+
+        const QString *val = resolve(ctx, op.var);
+        if (!val)
+            return NULL; // the error will be passed on
+        QString tmp = *val;
+
+        for (char m : op.mods) {
+            switch (m) {
+            case 'a': tmp = tmp.toLower(); break;
+            case 'A': tmp = tmp.toUpper(); break;
+            case 'f': {
+                int k = 0;
+                while (k < tmp.size() && !nm_argtemplate_space(tmp.at(k)))
+                    k++;
+                tmp.truncate(k);
+                break;
+            }
+            case 'n': case 'w': {
+                QChar *d = tmp.data();
+                int k = 0;
+                for (int i = 0; i < tmp.size(); i++)
+                    if (m == 'n' ? nm_argtemplate_alnum(d[i]) : !nm_argtemplate_space(d[i]))
+                        d[k++] = d[i];
+                tmp.truncate(k);
+                break;
+            }
+            case 's': tmp = tmp.trimmed(); break;
+            case 'S': tmp = tmp.simplified(); break;
+            case 'u': if (tmp.length() == 0) { nm_err_set("argtransform: empty substitution result for %s", qPrintable(tmpl->src.mid(op.spec_start, op.spec_len))); return NULL; }; break;
+            case 'x': {
+                QChar *d = tmp.data();
+                for (int i = 0; i < tmp.size(); i++)
+                    if (nm_argtemplate_space(d[i]))
+                        d[i] = QLatin1Char('_');
+                break;
+            }
+            }
+        }
+
+        for (char e : op.escapes) {
+            switch (e) {
+            case '"': {
+                // note: this matches the original sequence of replacements,
+                // where the backslashes added for the other characters were
+                // escaped again by the last one
+                QString esc;
+                esc.reserve(tmp.size() + tmp.size()/8);
+                const QChar *d = tmp.constData();
+                for (int i = 0; i < tmp.size(); i++) {
+                    QChar c = d[i];
+                    switch (c.unicode()) {
+                    case '"':  esc += QLatin1String("\\\\\""); break;
+                    case '\n': esc += QLatin1String("\\\\n");  break;
+                    case '\b': esc += QLatin1String("\\\\b");  break;
+                    case '\t': esc += QLatin1String("\\\\t");  break;
+                    case '\f': esc += QLatin1String("\\\\f");  break;
+                    case '\r': esc += QLatin1String("\\\\r");  break;
+                    case '\\': esc += QLatin1String("\\\\");   break;
+                    default:   esc += c;                       break;
+                    }
+                }
+                tmp = esc;
+                break;
+            }
+            case '$':
+                tmp = tmp.replace(QLatin1Char('\''), QLatin1String("'\"'\"'"));
+                break;
+            case '%':
+                tmp = QString::fromLatin1(QUrl::toPercentEncoding(tmp));
+                break;
+            }
+        }
+
+        res += tmp;
+    }
+
+    char *x = strdup(res.toUtf8().data());
+    if (!x)
+        nm_err_set("argtransform: could not allocate memory: %m");
+    return x;
+}
@@ -0,0 +1,62 @@
+#ifndef NM_ARGTRANSFORM_H
+#define NM_ARGTRANSFORM_H
+
+#include <QByteArray>
+#include <QString>
+#include <QVector>
+
+// NM_ARGTEMPLATE_VARS are the variables which can be substituted, by number.
+#define NM_ARGTEMPLATE_VARS \
+    X(1, selection)         \
+    X(2, locale)            \
+    X(3, book_path)         \
+    X(4, book_title)
+
+#define NM_ARGTEMPLATE_VAR(name) NM_ARGTEMPLATE_VAR_##name
+
+typedef enum {
+    NM_ARGTEMPLATE_VAR_NONE = 0,
+    #define X(num, name) \
+    NM_ARGTEMPLATE_VAR(name) = num,
+    NM_ARGTEMPLATE_VARS
+    #undef X
+} nm_argtemplate_var_t;
+
+// nm_argtemplate_resolve_t returns the value of a variable. It is only called
+// when a variable is used, so it should cache the value if getting it is
+// expensive. On error, it should return NULL and set nm_err.
+typedef const QString *(*nm_argtemplate_resolve_t)(void *ctx, nm_argtemplate_var_t var);
+
+// nm_argtemplate_op_t is a literal span of a template, optionally followed by a
+// substitution of the form {<var>|<modifiers>|<escapes>}.
+typedef struct {
+    int                  lit_start;  // of the literal span in the template source
+    int                  lit_len;
+    nm_argtemplate_var_t var;        // the variable to substitute after it, if any
+    int                  spec_start; // of the substitution in the template source (for errors)
+    int                  spec_len;
+    QByteArray           mods;       // modifiers (aAfnsSuwx), applied in order
+    QByteArray           escapes;    // escapes ("$%), applied in order
+} nm_argtemplate_op_t;
+
+// nm_argtemplate_t is a parsed selection menu action argument.
+typedef struct {
+    QString                       src;
+    QVector<nm_argtemplate_op_t> ops;
+} nm_argtemplate_t;
+
+// nm_argtemplate_parse parses an action argument. Anything which isn't a valid
+// substitution is kept as-is, so it can't fail. If arg is NULL, it is treated as
+// an empty string.
+void nm_argtemplate_parse(const char *arg, nm_argtemplate_t *out);
+
+// nm_argtemplate_static returns true if the argument doesn't contain any
+// substitutions (i.e. nm_argtemplate_apply would return it as-is).
+bool nm_argtemplate_static(const char *arg);
+
+// nm_argtemplate_apply substitutes the variables into a parsed template in a
+// single pass, and returns a new malloc'd string. Variables are only resolved
+// if they are used. On error, it returns NULL and sets nm_err.
+char *nm_argtemplate_apply(const nm_argtemplate_t *tmpl, nm_argtemplate_resolve_t resolve, void *ctx);
+
+#endif
@@ -13,6 +13,9 @@
 #include "config.h"
 #include "generator.h"
 #include "nickelmenu.h"
+#include "stall.h"
+#include "stats.h"
+#include "trace.h"
 #include "util.h"
 
 struct nm_config_file_t {
@@ -362,11 +365,11 @@ nm_config_t *nm_config_parse(nm_config_file_t *files) {
     for (nm_config_t *cur = state.cfg_s; cur; cur = cur->next) {
         switch (cur->type) {
         case NM_CONFIG_TYPE_MENU_ITEM:
-            NM_LOG("cfg(NM_CONFIG_TYPE_MENU_ITEM) : %d:%s",
+            NM_LOG_VERBOSE("cfg(NM_CONFIG_TYPE_MENU_ITEM) : %d:%s",
                 cur->value.menu_item->loc,
                 cur->value.menu_item->lbl);
             for (nm_menu_action_t *cur_act = cur->value.menu_item->action; cur_act; cur_act = cur_act->next)
-                NM_LOG("...cfg(NM_CONFIG_TYPE_MENU_ITEM) (%s%s%s) : %p:%s",
+                NM_LOG_VERBOSE("...cfg(NM_CONFIG_TYPE_MENU_ITEM) (%s%s%s) : %p:%s",
                     cur_act->on_success
                         ? "on_success"
                         : "",
@@ -387,14 +390,14 @@ nm_config_t *nm_config_parse(nm_config_file_t *files) {
             }
             break;
         case NM_CONFIG_TYPE_GENERATOR:
-            NM_LOG("cfg(NM_CONFIG_TYPE_GENERATOR) : %d:%s(%p):%s",
+            NM_LOG_VERBOSE("cfg(NM_CONFIG_TYPE_GENERATOR) : %d:%s(%p):%s",
                 cur->value.generator->loc,
                 cur->value.generator->desc,
                 cur->value.generator->generate,
                 cur->value.generator->arg);
             break;
         case NM_CONFIG_TYPE_EXPERIMENTAL:
-            NM_LOG("cfg(NM_CONFIG_TYPE_EXPERIMENTAL) : %s:%s",
+            NM_LOG_VERBOSE("cfg(NM_CONFIG_TYPE_EXPERIMENTAL) : %s:%s",
                 cur->value.experimental->key,
                 cur->value.experimental->val);
             break;
@@ -481,6 +484,11 @@ static bool nm_config_parse__line_generator(const char *type, char **line, nm_ge
     #undef X
     else NM_ERR_RET(true, "field 3: unknown generator '%s'", s_generate);
 
+    #define X(name) \
+    if (gn_out->generate == NM_GENERATOR(name)) gn_out->deps = NM_GENERATOR_DEPS(name);
+    NM_GENERATORS_DEPS
+    #undef X
+
     char *p_arg = strtrim(*line); // note: optional
     if (p_arg) gn_out->arg = p_arg;
 
@@ -635,6 +643,7 @@ static nm_config_parse__append__ret_t nm_config_parse__append_generator(nm_confi
         .loc      = gn->loc,
         .arg      = strdup(gn->arg ? gn->arg : ""),
         .generate = gn->generate,
+        .deps     = gn->deps,
     };
 
     if (!cfg_gn_n->desc || !cfg_gn_n->arg) {
@@ -757,11 +766,11 @@ bool nm_config_generate(nm_config_t *cfg, bool force_update) {
         if (cur->generated) {
             switch (cur->type) {
             case NM_CONFIG_TYPE_MENU_ITEM:
-                NM_LOG("cfg(NM_CONFIG_TYPE_MENU_ITEM) : %d:%s",
+                NM_LOG_VERBOSE("cfg(NM_CONFIG_TYPE_MENU_ITEM) : %d:%s",
                     cur->value.menu_item->loc,
                     cur->value.menu_item->lbl);
                 for (nm_menu_action_t *cur_act = cur->value.menu_item->action; cur_act; cur_act = cur_act->next)
-                    NM_LOG("...cfg(NM_CONFIG_TYPE_MENU_ITEM) (%s%s%s) : %p:%s",
+                    NM_LOG_VERBOSE("...cfg(NM_CONFIG_TYPE_MENU_ITEM) (%s%s%s) : %p:%s",
                         cur_act->on_success ? "on_success" : "",
                         (cur_act->on_success && cur_act->on_failure) ? ", " : "",
                         cur_act->on_failure ? "on_failure" : "",
@@ -769,14 +778,14 @@ bool nm_config_generate(nm_config_t *cfg, bool force_update) {
                         cur_act->arg);
                 break;
             case NM_CONFIG_TYPE_GENERATOR:
-                NM_LOG("cfg(NM_CONFIG_TYPE_GENERATOR) : %d:%s(%p):%s",
+                NM_LOG_VERBOSE("cfg(NM_CONFIG_TYPE_GENERATOR) : %d:%s(%p):%s",
                     cur->value.generator->loc,
                     cur->value.generator->desc,
                     cur->value.generator->generate,
                     cur->value.generator->arg);
                 break;
             case NM_CONFIG_TYPE_EXPERIMENTAL:
-                NM_LOG("cfg(NM_CONFIG_TYPE_EXPERIMENTAL) : %s:%s",
+                NM_LOG_VERBOSE("cfg(NM_CONFIG_TYPE_EXPERIMENTAL) : %s:%s",
                     cur->value.experimental->key,
                     cur->value.experimental->val);
                 break;
@@ -805,6 +814,24 @@ nm_menu_item_t **nm_config_get_menu(nm_config_t *cfg, size_t *n_out) {
     return it;
 }
 
+nm_generator_t **nm_config_get_generators(nm_config_t *cfg, size_t *n_out) {
+    *n_out = 0;
+    for (nm_config_t *cur = cfg; cur; cur = cur->next)
+        if (cur->type == NM_CONFIG_TYPE_GENERATOR)
+            (*n_out)++;
+
+    nm_generator_t **gn = calloc(*n_out, sizeof(nm_generator_t*));
+    if (!gn)
+        return NULL;
+
+    nm_generator_t **tmp = gn;
+    for (nm_config_t *cur = cfg; cur; cur = cur->next)
+        if (cur->type == NM_CONFIG_TYPE_GENERATOR)
+           *(tmp++) = cur->value.generator;
+
+    return gn;
+}
+
 const char *nm_config_experimental(nm_config_t *cfg, const char *key) {
     if (key)
         for (nm_config_t *cur = cfg; cur; cur = cur->next)
@@ -834,6 +861,8 @@ void nm_config_free(nm_config_t *cfg) {
             free(cfg->value.menu_item);
             break;
         case NM_CONFIG_TYPE_GENERATOR:
+            nm_generator_unwatch(cfg->value.generator);
+            free(cfg->value.generator->health.err);
             free(cfg->value.generator->arg);
             free(cfg->value.generator->desc);
             free(cfg->value.generator);
@@ -863,6 +892,14 @@ nm_menu_item_t **nm_global_config_items(size_t *n_out) {
     return nm_global_menu_config_items;
 }
 
+int nm_global_config_rev() {
+    return nm_global_menu_config_rev;
+}
+
+nm_generator_t **nm_global_config_generators(size_t *n_out) {
+    return nm_config_get_generators(nm_global_menu_config, n_out);
+}
+
 const char *nm_global_config_experimental(const char *key) {
     return nm_config_experimental(nm_global_menu_config, key);
 }
@@ -891,6 +928,27 @@ static void nm_global_config_replace(nm_config_t *cfg, const char *err) {
         nm_global_menu_config_files = NULL;
     }
 
+    nm_log_set_level(err ? NULL : nm_config_experimental(cfg, "log_level"));
+
+    const char *stats = err ? NULL : nm_config_experimental(cfg, "stats");
+    nm_stats_set_enabled(stats && !strcmp(stats, "1"));
+
+    const char *stall = err ? NULL : nm_config_experimental(cfg, "stall_threshold_ms");
+    char *stall_end;
+    long stall_ms = stall ? strtol(stall, &stall_end, 10) : 0;
+    if (stall && (!*stall || *stall_end || stall_ms < 0 || stall_ms > 60000)) {
+        NM_LOG("stall: invalid stall_threshold_ms '%s', must be between 0 and 60000, ignoring", stall);
+        stall_ms = 0;
+    }
+    nm_stall_set_threshold((unsigned)(stall_ms));
+
+    // stop coprocesses and watches kept for generators which were removed
+    size_t gens_n = 0;
+    nm_generator_t **gens = err ? NULL : nm_config_get_generators(cfg, &gens_n);
+    if (gens || !gens_n)
+        nm_generator_prune(gens, gens_n);
+    free(gens);
+
     if (err) {
         nm_global_menu_config_n        = 2;
         nm_global_menu_config_items    = calloc(nm_global_menu_config_n, sizeof(nm_menu_item_t*));
@@ -914,44 +972,59 @@ static void nm_global_config_replace(nm_config_t *cfg, const char *err) {
     }
 
     nm_global_menu_config = cfg;
+    uint64_t t = nm_trace_now();
     nm_global_menu_config_items = nm_config_get_menu(cfg, &nm_global_menu_config_n);
+    nm_trace_add(NM_TRACE_EVENT(config_get_menu), t, NULL);
     if (!nm_global_menu_config_items)
         NM_LOG("could not allocate memory");
 }
 
 int nm_global_config_update() {
+    NM_TRACE_SCOPE(config_update, NULL);
+    NM_STALL_SCOPE(config_update, NULL, NULL);
+    uint64_t t;
+
     NM_LOG("global: scanning for config files");
+    t = nm_trace_now();
     int state = nm_config_files_update(&nm_global_menu_config_files);
+    nm_trace_add(NM_TRACE_EVENT(config_files_update), t, NULL);
     if (state == -1) {
         const char *err = nm_err();
-        NM_LOG("... error: %s", err);
+        NM_LOG_ERROR("... error: %s", err);
         NM_LOG("global: freeing old config and replacing with error item");
         nm_global_config_replace(NULL, err);
         nm_global_menu_config_rev++;
+        NM_STATS_COUNT(config_error, 1);
         NM_ERR_RET(nm_global_menu_config_rev, "scan for config files: %s", err);
     }
     NM_LOG("global:%s changes detected", state == 0 ? "" : " no");
 
     if (state == 0) {
         NM_LOG("global: parsing new config");
+        t = nm_trace_now();
         nm_config_t *cfg = nm_config_parse(nm_global_menu_config_files);
+        nm_trace_add(NM_TRACE_EVENT(config_parse), t, NULL);
         if (!cfg) {
             const char *err = nm_err();
-            NM_LOG("... error: %s", err);
+            NM_LOG_ERROR("... error: %s", err);
             NM_LOG("global: freeing old config and replacing with error item");
             nm_global_config_replace(NULL, err);
             nm_global_menu_config_rev++;
+            NM_STATS_COUNT(config_error, 1);
             NM_ERR_RET(nm_global_menu_config_rev, "parse config files: %s", err);
         }
 
         NM_LOG("global: config updated, freeing old config and replacing with new one");
         nm_global_config_replace(cfg, NULL);
         nm_global_menu_config_rev++;
+        NM_STATS_COUNT(config_changed, 1);
         NM_LOG("global: done swapping config");
     }
 
     NM_LOG("global: running generators");
+    t = nm_trace_now();
     bool g_updated = nm_config_generate(nm_global_menu_config, false);
+    nm_trace_add(NM_TRACE_EVENT(config_generate), t, NULL);
     NM_LOG("global:%s generators updated", g_updated ? "" : " no");
 
     if (g_updated) {
@@ -965,11 +1038,14 @@ int nm_global_config_update() {
             nm_global_menu_config_items = NULL;
         }
 
+        t = nm_trace_now();
         nm_global_menu_config_items = nm_config_get_menu(nm_global_menu_config, &nm_global_menu_config_n);
+        nm_trace_add(NM_TRACE_EVENT(config_get_menu), t, NULL);
         if (!nm_global_menu_config_items) 
             NM_LOG("could not allocate memory");
 
         nm_global_menu_config_rev++;
+        NM_STATS_COUNT(config_changed, 1);
         NM_LOG("done replacing items");
     }
 
@@ -8,6 +8,7 @@ extern "C" {
 #include <stddef.h>
 
 #include "action.h"
+#include "generator.h"
 #include "nickelmenu.h"
 
 #if !(defined(NM_CONFIG_DIR) && defined(NM_CONFIG_DIR_DISP))
@@ -52,6 +53,11 @@ bool nm_config_generate(nm_config_t *cfg, bool force_update);
 // called.
 nm_menu_item_t **nm_config_get_menu(nm_config_t *cfg, size_t *n_out);
 
+// nm_config_get_generators gets a malloc'd array of pointers to the generators
+// defined in the config. These pointers will be valid until nm_config_free is
+// called.
+nm_generator_t **nm_config_get_generators(nm_config_t *cfg, size_t *n_out);
+
 // nm_config_experimental gets the first value of an arbitrary experimental
 // option. If it doesn't exist, NULL will be returned. The pointer will be valid
 // until nm_config_free is called.
@@ -66,6 +72,10 @@ void nm_config_free(nm_config_t *cfg);
 // nm_err is set, and otherwise, it is cleared.
 int nm_global_config_update();
 
+// nm_global_config_rev returns the current revision (see
+// nm_global_config_update), or -1 if it has never been updated.
+int nm_global_config_rev();
+
 // nm_global_config_items returns an array of pointers with the current menu
 // items (the pointer and the items it points to will remain valid until the
 // next time nm_global_config_update is called). The number of items is stored
@@ -75,6 +85,12 @@ int nm_global_config_update();
 // NULL is returned and n_out is set to 0.
 nm_menu_item_t **nm_global_config_items(size_t *n_out);
 
+// nm_global_config_generators returns a malloc'd array of pointers to the
+// generators in the current config (the generators will remain valid until the
+// next time nm_global_config_update is called). If there isn't a valid config,
+// n_out is set to 0.
+nm_generator_t **nm_global_config_generators(size_t *n_out);
+
 // nm_global_config_experimental gets the first value of an arbitrary
 // experimental option (the pointer will remain valid until the next time
 // nm_global_config_update is called). If it doesn't exist, NULL will be
@@ -1,26 +1,259 @@
 #define _GNU_SOURCE // asprintf
+#include <errno.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stddef.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#include <unistd.h>
+#include <sys/inotify.h>
 
 #include "action.h"
 #include "generator.h"
 #include "nickelmenu.h"
+#include "stall.h"
+#include "trace.h"
 #include "util.h"
 
+#define NM_GENERATOR_WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE | IN_MODIFY | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF)
+
+typedef struct {
+    int  wd;
+    char *name; // NULL to match any entry in the directory
+} nm_generator_watch_dep_t;
+
+struct nm_generator_watch_t {
+    nm_generator_t           *gen;
+    bool                     dirty; // a relevant event was received since the generator last ran
+    bool                     stale; // one of the watches was removed by the kernel (e.g. the dir was deleted)
+    size_t                   dep_n;
+    nm_generator_watch_dep_t *dep;
+    nm_generator_watch_t     *next;
+};
+
+// note: not thread safe
+static int                  nm_generator_watch_fd   = -1;   // shared inotify instance for all generators, created on first use
+static nm_generator_watch_t *nm_generator_watch_all = NULL; // all active watches
+
+static void nm_generator_watch_free(nm_generator_watch_t *w) {
+    for (size_t i = 0; i < w->dep_n; i++) {
+        bool used = false;
+        for (nm_generator_watch_t *o = nm_generator_watch_all; o && !used; o = o->next)
+            for (size_t j = 0; o != w && j < o->dep_n && !used; j++)
+                used = o->dep[j].wd == w->dep[i].wd;
+        for (size_t j = 0; j < i && !used; j++)
+            used = w->dep[j].wd == w->dep[i].wd;
+        if (!used && w->dep[i].wd != -1) // note: inotify returns the same wd for the same dir
+            inotify_rm_watch(nm_generator_watch_fd, w->dep[i].wd);
+        free(w->dep[i].name);
+    }
+    free(w->dep);
+    free(w);
+}
+
+// nm_generator_watch adds watches for the generator's dependencies. On error,
+// it is logged and the generator will fall back to being called every time.
+static void nm_generator_watch(nm_generator_t *gen) {
+    const char *const *deps = gen->deps(gen->arg);
+    if (!deps) {
+        NM_LOG("generator: (%s) (%s) doesn't have any dependencies for this argument, will check for updates every time", gen->desc, gen->arg);
+        return;
+    }
+
+    if (nm_generator_watch_fd == -1 && (nm_generator_watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1) {
+        NM_LOG("generator: could not initialize inotify, will check for updates every time: %m");
+        return;
+    }
+
+    nm_generator_watch_t *w = calloc(1, sizeof(nm_generator_watch_t));
+    for (const char *const *d = deps; *d; d++)
+        w->dep_n++;
+    w->gen = gen;
+    w->dep = calloc(w->dep_n, sizeof(nm_generator_watch_dep_t));
+    for (size_t i = 0; i < w->dep_n; i++)
+        w->dep[i].wd = -1;
+
+    for (size_t i = 0; i < w->dep_n; i++) {
+        char *dir = strdup(deps[i]);
+        char *sep = strrchr(dir, '/');
+
+        if (!sep || sep == dir) {
+            NM_LOG("generator: (%s) (%s) returned an invalid dependency '%s', will check for updates every time", gen->desc, gen->arg, deps[i]);
+            free(dir);
+            nm_generator_watch_free(w);
+            return;
+        }
+
+        *sep = '\0';
+        w->dep[i].name = sep[1] ? strdup(&sep[1]) : NULL;
+
+        if ((w->dep[i].wd = inotify_add_watch(nm_generator_watch_fd, dir, NM_GENERATOR_WATCH_MASK | IN_ONLYDIR)) == -1) {
+            NM_LOG("generator: could not watch '%s' for (%s) (%s), will check for updates every time: %m", dir, gen->desc, gen->arg);
+            free(dir);
+            nm_generator_watch_free(w);
+            return;
+        }
+
+        NM_LOG("generator: watching '%s' (%s) for (%s) (%s)", dir, w->dep[i].name ?: "*", gen->desc, gen->arg);
+        free(dir);
+    }
+
+    w->next = nm_generator_watch_all;
+    nm_generator_watch_all = w;
+    gen->watch = w;
+}
+
+void nm_generator_unwatch(nm_generator_t *gen) {
+    if (!gen->watch)
+        return;
+    for (nm_generator_watch_t **p = &nm_generator_watch_all; *p; p = &(*p)->next) {
+        if (*p == gen->watch) {
+            *p = gen->watch->next;
+            break;
+        }
+    }
+    nm_generator_watch_free(gen->watch);
+    gen->watch = NULL;
+}
+
+void nm_generator_prune(nm_generator_t **gens, size_t n) {
+    const char **args = calloc(n ? n : 1, sizeof(const char*));
+    if (!args) {
+        NM_LOG("generator: could not allocate memory for pruning");
+        return;
+    }
+
+    size_t args_n;
+    #define X(name)                                  \
+    args_n = 0;                                      \
+    for (size_t i = 0; i < n; i++)                   \
+        if (gens[i]->generate == NM_GENERATOR(name)) \
+            args[args_n++] = gens[i]->arg;           \
+    NM_GENERATOR_PRUNE(name)(args, args_n);
+    NM_GENERATORS_PRUNE
+    #undef X
+
+    free(args);
+}
+
+void nm_generator_invalidate(nm_generator_fn_t generate) {
+    for (nm_generator_watch_t *w = nm_generator_watch_all; w; w = w->next)
+        if (w->gen->generate == generate)
+            w->dirty = true;
+}
+
+int nm_generator_watch_fileno() {
+    return nm_generator_watch_fd;
+}
+
+bool nm_generator_watch_poll() {
+    if (nm_generator_watch_fd == -1)
+        return false;
+
+    bool dirty = false;
+
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    for (;;) {
+        ssize_t n = read(nm_generator_watch_fd, buf, sizeof(buf));
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            if (n == -1 && errno != EAGAIN)
+                NM_LOG("generator: error reading inotify events: %m");
+            return dirty;
+        }
+
+        for (char *p = buf; p < buf + n;) {
+            const struct inotify_event *ev = (const struct inotify_event*)(p);
+            p += sizeof(struct inotify_event) + ev->len;
+
+            for (nm_generator_watch_t *w = nm_generator_watch_all; w; w = w->next) {
+                if (ev->mask & IN_Q_OVERFLOW) {
+                    w->dirty = dirty = true;
+                    continue;
+                }
+                for (size_t i = 0; i < w->dep_n; i++) {
+                    if (w->dep[i].wd != ev->wd)
+                        continue;
+                    if (ev->mask & IN_IGNORED)
+                        w->stale = w->dirty = dirty = true;
+                    else if (!w->dep[i].name || (ev->len && !strcmp(w->dep[i].name, ev->name)) || (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF)))
+                        w->dirty = dirty = true;
+                }
+            }
+        }
+    }
+}
+
+static long nm_generator_ms_between(struct timespec a, struct timespec b) {
+    return (b.tv_sec - a.tv_sec) * 1000 + (b.tv_nsec - a.tv_nsec) / 1000000;
+}
+
 nm_menu_item_t **nm_generator_do(nm_generator_t *gen, size_t *sz_out) {
+    nm_generator_health_t *h = &gen->health;
+    struct timespec start;
+
+    if (h->breaker == NM_GENERATOR_BREAKER_OPEN) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        long rem = nm_generator_ms_between(start, h->retry_at);
+        if (rem > 0) {
+            NM_LOG("generator: skipping generator (%s) (%s), breaker is open (retry in %ld ms, %u consecutive failures)", gen->desc, gen->arg, rem, h->failures);
+            nm_err_set(NULL);
+            return NULL;
+        }
+        NM_LOG("generator: breaker for generator (%s) (%s) is now half-open, trying again", gen->desc, gen->arg);
+        h->breaker = NM_GENERATOR_BREAKER_HALF_OPEN;
+    }
+
+    if (gen->deps) {
+        if (gen->time.tv_sec || gen->time.tv_nsec) {
+            nm_generator_watch_poll();
+            if (gen->watch && !gen->watch->dirty) {
+                NM_LOG("generator: skipping generator (%s) (%s), no relevant changes to its dependencies", gen->desc, gen->arg);
+                nm_err_set(NULL);
+                return NULL;
+            }
+        }
+
+        // set up the watches (or clear the flag) before running the generator
+        // so changes made while it is running aren't missed
+        if (gen->watch && gen->watch->stale)
+            nm_generator_unwatch(gen);
+        if (!gen->watch)
+            nm_generator_watch(gen);
+        if (gen->watch)
+            gen->watch->dirty = false;
+    }
+
     NM_LOG("generator: running generator (%s) (%s) (%d) (%p)", gen->desc, gen->arg, gen->loc, gen->generate);
 
     struct timespec old = gen->time;
     size_t sz = (size_t)(-1); // this should always be set by generate upon success, but we'll initialize it just in case
+
+    uint64_t t = nm_trace_now();
+    bool stall = nm_stall_enter(NM_STALL_SECTION(generator), gen->arg, gen->desc);
+    clock_gettime(CLOCK_MONOTONIC, &start);
     nm_menu_item_t **items = gen->generate(gen->arg, &gen->time, &sz);
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (stall)
+        nm_stall_exit();
+    nm_trace_add(NM_TRACE_EVENT(generator), t, gen->desc);
+
+    h->runs++;
+    h->last_ms = nm_generator_ms_between(start, end);
+    if (h->last_ms > h->max_ms)
+        h->max_ms = h->last_ms;
 
     if (items && old.tv_sec == gen->time.tv_sec && old.tv_nsec == gen->time.tv_nsec)
         NM_LOG("generator: bug: new items were returned, but time wasn't changed");
 
     const char *err = nm_err();
 
+    if (err && gen->watch)
+        gen->watch->dirty = true; // try again next time
+
     if (!old.tv_sec && !old.tv_nsec && !err && !items)
         NM_LOG("generator: warning: no existing items (time == 0), but no new items or error were returned");
 
@@ -28,6 +261,43 @@ nm_menu_item_t **nm_generator_do(nm_generator_t *gen, size_t *sz_out) {
         if (items)
             NM_LOG("generator: bug: items should be null on error");
 
+        h->errors++;
+        h->failures++;
+
+        if (h->breaker == NM_GENERATOR_BREAKER_HALF_OPEN) {
+            h->cooldown_ms *= 2;
+            if (h->cooldown_ms > NM_GENERATOR_BREAKER_COOLDOWN_MAX_MS)
+                h->cooldown_ms = NM_GENERATOR_BREAKER_COOLDOWN_MAX_MS;
+            h->breaker = NM_GENERATOR_BREAKER_OPEN;
+        } else if (h->failures >= NM_GENERATOR_BREAKER_FAILURES) {
+            h->cooldown_ms = NM_GENERATOR_BREAKER_COOLDOWN_MS;
+            h->breaker = NM_GENERATOR_BREAKER_OPEN;
+        }
+
+        if (h->breaker == NM_GENERATOR_BREAKER_OPEN) {
+            h->retry_at = end;
+            h->retry_at.tv_sec  += h->cooldown_ms / 1000;
+            h->retry_at.tv_nsec += (h->cooldown_ms % 1000) * 1000000;
+            if (h->retry_at.tv_nsec >= 1000000000) {
+                h->retry_at.tv_sec++;
+                h->retry_at.tv_nsec -= 1000000000;
+            }
+            NM_LOG("generator: breaker for generator (%s) (%s) opened after %u consecutive failures, cooldown %ld ms", gen->desc, gen->arg, h->failures, h->cooldown_ms);
+        }
+
+        // regenerate everything once it works again, since the error item
+        // replaced the previous items
+        gen->time = (struct timespec){0, 0};
+
+        if (h->failures > 1 && h->err && !strcmp(h->err, err)) {
+            NM_LOG("generator: generator error (%s) (%s), keeping existing error item: %s", gen->desc, gen->arg, err);
+            nm_err_set(NULL);
+            return NULL;
+        }
+
+        free(h->err);
+        h->err = strdup(err);
+
         NM_LOG("generator: generator error (%s) (%s), replacing with error item: %s", gen->desc, gen->arg, err);
         sz = 1;
         items = calloc(sz, sizeof(nm_menu_item_t*));
@@ -39,6 +309,14 @@ nm_menu_item_t **nm_generator_do(nm_generator_t *gen, size_t *sz_out) {
         asprintf(&items[0]->action->arg, "%s: %s", gen->desc, err);
         items[0]->action->on_failure = true;
         items[0]->action->on_success = true;
+    } else {
+        if (h->breaker != NM_GENERATOR_BREAKER_CLOSED)
+            NM_LOG("generator: breaker for generator (%s) (%s) closed", gen->desc, gen->arg);
+        h->breaker     = NM_GENERATOR_BREAKER_CLOSED;
+        h->failures    = 0;
+        h->cooldown_ms = 0;
+        free(h->err);
+        h->err = NULL;
     }
 
     if (!err && !items && (old.tv_sec != gen->time.tv_sec || old.tv_nsec != gen->time.tv_nsec))
@@ -61,3 +339,37 @@ nm_menu_item_t **nm_generator_do(nm_generator_t *gen, size_t *sz_out) {
     *sz_out = sz;
     return items;
 }
+
+nm_menu_item_t **nm_generator_placeholder(const char *lbl, const char *msg, size_t *sz_out) {
+    nm_menu_item_t **items = calloc(1, sizeof(nm_menu_item_t*));
+    items[0] = calloc(1, sizeof(nm_menu_item_t));
+    items[0]->lbl = strdup(lbl);
+    items[0]->action = calloc(1, sizeof(nm_menu_action_t));
+    items[0]->action->act = NM_ACTION(dbg_msg);
+    items[0]->action->arg = strdup(msg);
+    items[0]->action->on_failure = true;
+    items[0]->action->on_success = true;
+    *sz_out = 1;
+    return items;
+}
+
+char *nm_generator_health_str(nm_generator_t *gen) {
+    nm_generator_health_t *h = &gen->health;
+
+    char tmp[32] = "";
+    if (h->breaker == NM_GENERATOR_BREAKER_OPEN) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        snprintf(tmp, sizeof(tmp), " (retry in %ld ms)", nm_generator_ms_between(now, h->retry_at));
+    }
+
+    char *str;
+    if (asprintf(&str, "%s:%s: %s%s, %u consecutive failures, %u runs, %u errors, last %ld ms, max %ld ms%s%s",
+        gen->desc, gen->arg,
+        h->breaker == NM_GENERATOR_BREAKER_OPEN      ? "open" :
+        h->breaker == NM_GENERATOR_BREAKER_HALF_OPEN ? "half-open" : "closed", tmp,
+        h->failures, h->runs, h->errors, h->last_ms, h->max_ms,
+        h->err ? ", last error: " : "", h->err ? h->err : "") == -1)
+        return NULL;
+    return str;
+}
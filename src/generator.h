@@ -12,8 +12,10 @@ extern "C" {
 // pointers to malloc'd nm_menu_item_t's, and write the number of items to
 // out_sz. The menu item locations must not be set. On error, nm_err must be
 // set, NULL must be returned, and sz_out is undefined. If no entries are
-// generated, NULL must be returned with sz_out set to 0. All strings should
-// also be malloc'd. On success, nm_err must be cleared.
+// generated, NULL must be returned with sz_out set to 0 (note that this keeps
+// the previously generated items, so if there can be items one time and none
+// the next, nm_generator_placeholder should be used instead). All strings
+// should also be malloc'd. On success, nm_err must be cleared.
 //
 // time_in_out will not be NULL, and contains zero or the last modification time
 // for the generator. If it is zero, the generator should generate the items as
@@ -27,20 +29,116 @@ extern "C" {
 // as changes in those will always cause the time to be set to zero.
 typedef nm_menu_item_t **(*nm_generator_fn_t)(const char *arg, struct timespec *time_in_out, size_t *sz_out);
 
+// nm_generator_deps_fn_t optionally declares the paths a generator depends on.
+// It must return a NULL-terminated array of absolute paths which remains valid
+// until the next call, or NULL if the dependencies can't be described by paths
+// for the specified argument. If a path ends with a slash, any change to an
+// entry in that directory is relevant. Otherwise, only creation, deletion,
+// modification, and attribute changes of that exact path are relevant (it does
+// not need to exist). While the paths are being watched, the generator will
+// only be called (with a nonzero time) after a relevant inotify event has been
+// received, so the quick check described above won't run on every update.
+typedef const char *const *(*nm_generator_deps_fn_t)(const char *arg);
+
+// nm_generator_prune_fn_t optionally frees the long-lived state (e.g.
+// processes or file descriptors) a generator keeps for each argument, for the
+// arguments which aren't in args (the arguments of all configured instances of
+// the generator).
+typedef void (*nm_generator_prune_fn_t)(const char *const *args, size_t n);
+
+// NM_GENERATOR_TIMEOUT_MS is the deadline for generators which need to wait on
+// something external (e.g. IPC or another process), since they block Nickel.
+#ifndef NM_GENERATOR_TIMEOUT_MS
+#define NM_GENERATOR_TIMEOUT_MS 2000
+#endif
+
+typedef struct nm_generator_watch_t nm_generator_watch_t;
+
+// NM_GENERATOR_BREAKER_FAILURES is the number of consecutive failures after
+// which the circuit breaker opens and the generator is not run until the
+// cooldown expires. The cooldown starts at NM_GENERATOR_BREAKER_COOLDOWN_MS and
+// doubles every time the trial run after it fails (up to
+// NM_GENERATOR_BREAKER_COOLDOWN_MAX_MS).
+#ifndef NM_GENERATOR_BREAKER_FAILURES
+#define NM_GENERATOR_BREAKER_FAILURES 2
+#endif
+#ifndef NM_GENERATOR_BREAKER_COOLDOWN_MS
+#define NM_GENERATOR_BREAKER_COOLDOWN_MS 5000
+#endif
+#ifndef NM_GENERATOR_BREAKER_COOLDOWN_MAX_MS
+#define NM_GENERATOR_BREAKER_COOLDOWN_MAX_MS 300000
+#endif
+
+typedef enum {
+    NM_GENERATOR_BREAKER_CLOSED    = 0, // runs normally
+    NM_GENERATOR_BREAKER_OPEN      = 1, // not run until retry_at, the error item is kept
+    NM_GENERATOR_BREAKER_HALF_OPEN = 2, // the next run is a trial which closes or re-opens the breaker
+} nm_generator_breaker_t;
+
+typedef struct {
+    nm_generator_breaker_t breaker;
+    unsigned int    failures;    // consecutive
+    unsigned int    runs;        // total
+    unsigned int    errors;      // total
+    long            last_ms;     // latency of the last run
+    long            max_ms;      // max latency of all runs
+    long            cooldown_ms; // current cooldown (if not closed)
+    struct timespec retry_at;    // CLOCK_MONOTONIC (if open)
+    char            *err;        // last error message, if failing
+} nm_generator_health_t;
+
 typedef struct {
     char *desc; // only used for making the errors more meaningful (it is the title)
     char *arg;
     nm_menu_location_t loc;
     nm_generator_fn_t generate; // should be as quick as possible with a short timeout, as it will block startup
+    nm_generator_deps_fn_t deps; // optional
     struct timespec time;
+    nm_generator_watch_t *watch; // internal, managed by nm_generator_do and nm_generator_unwatch
+    nm_generator_health_t health; // updated by nm_generator_do, err must be freed
 } nm_generator_t;
 
 // nm_generator_do runs a generator and returns the generated items, if any, or
 // an item which shows the error returned by the generator. If NULL is returned,
 // no items needed to be updated (set time to zero to force an update) (sz_out
-// is undefined).
+// is undefined). If the generator fails repeatedly, it won't be run again until
+// the breaker's cooldown expires, and the existing error item will be kept.
 nm_menu_item_t **nm_generator_do(nm_generator_t *gen, size_t *sz_out);
 
+// nm_generator_placeholder returns a single malloc'd item with the specified
+// label which shows msg when pressed, for generators to return when they have
+// no entries to show.
+nm_menu_item_t **nm_generator_placeholder(const char *lbl, const char *msg, size_t *sz_out);
+
+// nm_generator_health_str returns a malloc'd single-line description of the
+// generator's health.
+char *nm_generator_health_str(nm_generator_t *gen);
+
+// nm_generator_invalidate marks generators using the specified function as
+// needing to be run again even if their dependencies haven't changed (e.g. if
+// it finished updating asynchronously). It must be called from the same thread
+// as nm_generator_do.
+void nm_generator_invalidate(nm_generator_fn_t generate);
+
+// nm_generator_watch_fileno returns the inotify instance used to watch the
+// generators' dependencies, or -1 if it hasn't been created yet. When it
+// becomes readable, nm_generator_watch_poll should be called.
+int nm_generator_watch_fileno();
+
+// nm_generator_watch_poll reads all pending inotify events without blocking and
+// marks the affected generators as dirty. It returns true if any were marked.
+// It must be called from the same thread as nm_generator_do.
+bool nm_generator_watch_poll();
+
+// nm_generator_prune frees the state kept by generators for arguments which
+// aren't used by any of the specified generators anymore. It must be called
+// from the same thread as nm_generator_do.
+void nm_generator_prune(nm_generator_t **gens, size_t n);
+
+// nm_generator_unwatch removes the inotify watches added for the generator's
+// dependencies, if any. It must be called before a generator is freed.
+void nm_generator_unwatch(nm_generator_t *gen);
+
 #define NM_GENERATOR(name) nm_generator_##name
 
 #ifdef __cplusplus
@@ -49,15 +147,61 @@ nm_menu_item_t **nm_generator_do(nm_generator_t *gen, size_t *sz_out);
 #define NM_GENERATOR_(name) nm_menu_item_t **NM_GENERATOR(name)(const char *arg, struct timespec *time_in_out, size_t *sz_out)
 #endif
 
+#define NM_GENERATOR_DEPS(name) nm_generator_deps_##name
+
+#ifdef __cplusplus
+#define NM_GENERATOR_DEPS_(name) extern "C" const char *const *NM_GENERATOR_DEPS(name)(const char *arg)
+#else
+#define NM_GENERATOR_DEPS_(name) const char *const *NM_GENERATOR_DEPS(name)(const char *arg)
+#endif
+
+#define NM_GENERATOR_PRUNE(name) nm_generator_prune_##name
+
+#ifdef __cplusplus
+#define NM_GENERATOR_PRUNE_(name) extern "C" void NM_GENERATOR_PRUNE(name)(const char *const *args, size_t n)
+#else
+#define NM_GENERATOR_PRUNE_(name) void NM_GENERATOR_PRUNE(name)(const char *const *args, size_t n)
+#endif
+
 #define NM_GENERATORS \
     X(_test)          \
     X(_test_time)     \
-    X(kfmon)
+    X(kfmon)          \
+    X(script)         \
+    X(dir)            \
+    X(library)
+
+// NM_GENERATORS_DEPS lists the generators which also implement
+// NM_GENERATOR_DEPS_.
+#define NM_GENERATORS_DEPS \
+    X(kfmon)               \
+    X(dir)                 \
+    X(library)
+
+// NM_GENERATORS_PRUNE lists the generators which also implement
+// NM_GENERATOR_PRUNE_.
+#define NM_GENERATORS_PRUNE \
+    X(script)               \
+    X(dir)
 
 #define X(name) NM_GENERATOR_(name);
 NM_GENERATORS
 #undef X
 
+#define X(name) NM_GENERATOR_DEPS_(name);
+NM_GENERATORS_DEPS
+#undef X
+
+#define X(name) NM_GENERATOR_PRUNE_(name);
+NM_GENERATORS_PRUNE
+#undef X
+
+// nm_generator_library_current gets the content ID and title of the book which
+// was opened most recently (i.e. the one open in the reader, if any) from the
+// same database connection as the library generator. The strings are malloc'd.
+// On error, -1 is returned and nm_err is set.
+int nm_generator_library_current(char **id_out, char **title_out);
+
 #ifdef __cplusplus
 }
 #endif
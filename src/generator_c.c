@@ -1,13 +1,22 @@
 #define _GNU_SOURCE // asprintf
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <linux/limits.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
+#include <sys/inotify.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
+#include "action.h"
+#include "config.h"
 #include "generator.h"
 #include "kfmon.h"
 #include "nickelmenu.h"
@@ -87,36 +96,161 @@ NM_GENERATOR_(_test_time) {
     return items;
 }
 
+// nm_generator_kfmon_arg parses the argument of the kfmon generator into the
+// index of the async state to use and the TTL in seconds. On error, -1 is
+// returned and nm_err is set.
+static int nm_generator_kfmon_arg(const char *arg, long *ttl_out) {
+    *ttl_out = 0;
+
+    // Default with no arg or an empty arg is to request a gui-listing
+    const char *ttl = arg ? strchr(arg, ':') : NULL;
+    size_t n = ttl ? (size_t)(ttl - arg) : (arg ? strlen(arg) : 0);
+
+    int idx;
+    if (!n || (n == 3 && !strncmp(arg, "gui", 3))) {
+        idx = 0;
+    } else if (n == 3 && !strncmp(arg, "all", 3)) {
+        idx = 1;
+    } else {
+        NM_ERR_RET(-1, "invalid argument '%s': if specified, must be either gui or all, optionally followed by a colon and a refresh interval", arg);
+    }
+
+    if (ttl) {
+        char *tmp;
+        *ttl_out = strtol(++ttl, &tmp, 10);
+        NM_CHECK(-1, *ttl && !*tmp && *ttl_out >= 0, "invalid refresh interval '%s': must be a non-negative integer", ttl);
+    }
+
+    nm_err_set(NULL);
+    return idx;
+}
+
+NM_GENERATOR_DEPS_(kfmon) {
+    static const char *const deps[] = {KFMON_IPC_SOCKET, NULL};
+    long ttl;
+    if (nm_generator_kfmon_arg(arg, &ttl) == -1 || ttl)
+        return NULL; // the generator needs to run to check the refresh interval
+    return deps;
+}
+
+// nm_generator_kfmon_async_t is the state of an asynchronous list request for
+// the kfmon generator. There is one for each command.
+typedef struct {
+    const char         *cmd;
+    bool               pending; // a request is in progress
+    bool               ready;   // a reply was received, but hasn't been used yet
+    bool               changed; // KFMon notified us of a change since the last request
+    int                status;
+    struct timespec    mtime;   // of the socket when the request was made
+    struct timespec    listed;  // CLOCK_MONOTONIC when the request was made
+    kfmon_watch_list_t list;
+} nm_generator_kfmon_async_t;
+
+static nm_generator_kfmon_async_t nm_generator_kfmon_async[] = { // note: not thread safe
+    {.cmd = "gui-list"},
+    {.cmd = "list"},
+};
+
+static void nm_generator_kfmon_done(void *ctx) {
+    nm_generator_kfmon_async_t *a = ctx;
+    a->pending = false;
+    a->ready   = true;
+    nm_generator_invalidate(NM_GENERATOR(kfmon));
+    nm_menu_prewarm();
+}
+
+static void nm_generator_kfmon_changed(void *ctx) {
+    (void) ctx;
+    for (size_t i = 0; i < sizeof(nm_generator_kfmon_async)/sizeof(*nm_generator_kfmon_async); i++)
+        nm_generator_kfmon_async[i].changed = true;
+    nm_generator_invalidate(NM_GENERATOR(kfmon));
+    nm_menu_prewarm();
+}
+
+// nm_generator_kfmon_stale checks whether the items need to be updated even
+// though KFMon wasn't restarted.
+static bool nm_generator_kfmon_stale(nm_generator_kfmon_async_t *a, long ttl) {
+    if (a->changed)
+        return true;
+
+    // If KFMon can't tell us about changes, fall back to polling.
+    if (ttl && !nm_kfmon_subscribed()) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (now.tv_sec - a->listed.tv_sec >= ttl)
+            return true;
+    }
+    return false;
+}
+
 NM_GENERATOR_(kfmon) {
+    long ttl;
+    int idx = nm_generator_kfmon_arg(arg, &ttl);
+    if (idx == -1)
+        return NULL; // the error will be passed on
+    nm_generator_kfmon_async_t *a = &nm_generator_kfmon_async[idx];
+
+    // Ask KFMon to tell us when its list changes (if it can).
+    static bool subscribed = false;
+    if (!subscribed) {
+        nm_kfmon_post_subscribe(nm_generator_kfmon_changed, NULL);
+        subscribed = true;
+    }
+
     struct stat sb;
     if (stat(KFMON_IPC_SOCKET, &sb))
         NM_ERR_RET(NULL, "error checking '%s': stat: %m", KFMON_IPC_SOCKET);
 
-    if (time_in_out->tv_sec == sb.st_mtim.tv_sec && time_in_out->tv_nsec == sb.st_mtim.tv_nsec) {
+    if (time_in_out->tv_sec == sb.st_mtim.tv_sec && time_in_out->tv_nsec == sb.st_mtim.tv_nsec && !a->ready && !nm_generator_kfmon_stale(a, ttl)) {
         nm_err_set(NULL);
         return NULL;
     }
 
-    // Default with no arg or an empty arg is to request a gui-listing
-    const char *kfmon_cmd = NULL;
-    if (!arg || !*arg || !strcmp(arg, "gui")) {
-        kfmon_cmd = "gui-list";
-    } else if (!strcmp(arg, "all")) {
-        kfmon_cmd = "list";
-    } else {
-        NM_ERR_RET(NULL, "invalid argument '%s': if specified, must be either gui or all", arg);
-    }
-
     // We'll want to retrieve our watch list in there.
     kfmon_watch_list_t list = { 0 };
-    int status = nm_kfmon_list_request(kfmon_cmd, &list);
+    int status;
+
+    if (!time_in_out->tv_sec && !time_in_out->tv_nsec) {
+        // The items are needed now (e.g. the config was just loaded), so we
+        // have to wait for KFMon.
+        if (a->ready) {
+            kfmon_teardown_list(&a->list);
+            a->list  = (kfmon_watch_list_t){ 0 };
+            a->ready = false;
+        }
+        a->changed = false;
+        clock_gettime(CLOCK_MONOTONIC, &a->listed);
+        status = nm_kfmon_list_request(a->cmd, &list);
+    } else if (a->ready) {
+        // Use the reply to the request we made last time.
+        list   = a->list;
+        status = a->status;
+        sb.st_mtim = a->mtime; // if it changed since then, we'll update again next time
+        a->list  = (kfmon_watch_list_t){ 0 };
+        a->ready = false;
+    } else {
+        // Otherwise, don't block Nickel while KFMon replies, and keep the
+        // existing items until it does.
+        if (!a->pending) {
+            a->pending = true;
+            a->changed = false;
+            a->mtime   = sb.st_mtim;
+            clock_gettime(CLOCK_MONOTONIC, &a->listed);
+            nm_kfmon_post_list_request(a->cmd, &a->list, &a->status, nm_generator_kfmon_done, a);
+        }
+        nm_err_set(NULL);
+        return NULL;
+    }
 
     // If there was an error, handle it now.
-    if (nm_kfmon_error_handler(status))
+    if (nm_kfmon_error_handler(status)) {
+        kfmon_teardown_list(&list);
         return NULL; // the error will be passed on
+    }
 
     // Handle an empty listing safely
     if (list.count == 0) {
+        *time_in_out = sb.st_mtim;
         *sz_out = 0;
         nm_err_set(NULL);
         return NULL;
@@ -127,16 +261,15 @@ NM_GENERATOR_(kfmon) {
     nm_menu_item_t **items = calloc(list.count, sizeof(nm_menu_item_t*));
 
     // Walk the list to populate the items array
-    size_t i = 0;
-    for (kfmon_watch_node_t *node = list.head; node != NULL; node = node->next) {
+    for (size_t i = 0; i < list.count; i++) {
+        const kfmon_watch_t *watch = &list.watches[i];
         items[i] = calloc(1, sizeof(nm_menu_item_t));
         items[i]->action = calloc(1, sizeof(nm_menu_action_t));
-        items[i]->lbl = strdup(node->watch.label);
+        items[i]->lbl = strdup(kfmon_watch_label(&list, watch));
         items[i]->action->act = NM_ACTION(kfmon);
-        items[i]->action->arg = strdup(node->watch.filename);
+        items[i]->action->arg = strdup(kfmon_watch_filename(&list, watch));
         items[i]->action->on_failure = true;
         items[i]->action->on_success = true;
-        i++;
     }
 
     // Destroy the list now that we've dumped it into an array of nm_menu_item_t
@@ -146,3 +279,296 @@ NM_GENERATOR_(kfmon) {
     nm_err_set(NULL);
     return items;
 }
+
+// nm_generator_dir_t is a sorted index of the matching files in a directory,
+// which is kept up to date incrementally using inotify. There is one for each
+// unique argument, and it is kept across config reloads.
+typedef struct nm_generator_dir_t {
+    char   *arg;
+    int    fd;      // private inotify instance, -1 if the index needs to be rebuilt
+    char   **names; // sorted with strcmp
+    size_t n;
+    size_t cap;
+    bool   changed; // since the items were last generated
+    struct nm_generator_dir_t *next;
+} nm_generator_dir_t;
+
+static nm_generator_dir_t *nm_generator_dir_all = NULL; // note: not thread safe
+
+// nm_generator_dir_split splits the argument into the directory and the
+// pattern. It returns false if the argument is invalid.
+static bool nm_generator_dir_split(const char *arg, char *dir, const char **pattern) {
+    const char *sep = strrchr(arg, '/');
+    if (!sep || sep == arg || !sep[1] || (size_t)(sep - arg) >= PATH_MAX)
+        return false;
+    memcpy(dir, arg, sep - arg);
+    dir[sep - arg] = '\0';
+    *pattern = sep + 1;
+    return true;
+}
+
+// nm_generator_dir_find returns the index of name, or where it should be
+// inserted if it isn't in the index (in which case found is set to false).
+static size_t nm_generator_dir_find(nm_generator_dir_t *d, const char *name, bool *found) {
+    size_t lo = 0, hi = d->n;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        int c = strcmp(d->names[mid], name);
+        if (!c) {
+            *found = true;
+            return mid;
+        }
+        if (c < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    *found = false;
+    return lo;
+}
+
+static void nm_generator_dir_add(nm_generator_dir_t *d, const char *name) {
+    bool found;
+    size_t i = nm_generator_dir_find(d, name, &found);
+    if (found)
+        return;
+    if (d->n == d->cap) {
+        d->cap = d->cap ? d->cap * 2 : 64;
+        d->names = realloc(d->names, d->cap * sizeof(char*));
+    }
+    memmove(&d->names[i+1], &d->names[i], (d->n - i) * sizeof(char*));
+    d->names[i] = strdup(name);
+    d->n++;
+    d->changed = true;
+}
+
+static void nm_generator_dir_remove(nm_generator_dir_t *d, const char *name) {
+    bool found;
+    size_t i = nm_generator_dir_find(d, name, &found);
+    if (!found)
+        return;
+    free(d->names[i]);
+    memmove(&d->names[i], &d->names[i+1], (d->n - i - 1) * sizeof(char*));
+    d->n--;
+    d->changed = true;
+}
+
+static int nm_generator_dir_cmp(const void *a, const void *b) {
+    return strcmp(*(char *const *)(a), *(char *const *)(b));
+}
+
+static bool nm_generator_dir_match(const char *pattern, const char *name) {
+    return name[0] != '.' && !fnmatch(pattern, name, 0);
+}
+
+// nm_generator_dir_scan rebuilds the index from scratch. The watch is added
+// before the directory is read so no changes are missed. On error, nm_err is
+// set and false is returned.
+static bool nm_generator_dir_scan(nm_generator_dir_t *d, const char *dir, const char *pattern) {
+    if (d->fd != -1)
+        close(d->fd);
+    for (size_t i = 0; i < d->n; i++)
+        free(d->names[i]);
+    d->n = 0;
+    d->changed = true;
+
+    if ((d->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1)
+        NM_ERR_RET(false, "could not initialize inotify: %m");
+
+    if (inotify_add_watch(d->fd, dir, IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR) == -1) {
+        close(d->fd);
+        d->fd = -1;
+        NM_ERR_RET(false, "could not watch directory '%s': %m", dir);
+    }
+
+    DIR *dh = opendir(dir);
+    if (!dh) {
+        close(d->fd);
+        d->fd = -1;
+        NM_ERR_RET(false, "could not open directory '%s': %m", dir);
+    }
+
+    for (struct dirent *de; (de = readdir(dh));) {
+        if (!nm_generator_dir_match(pattern, de->d_name))
+            continue;
+
+        // only stat if the filesystem doesn't tell us the type, or to check
+        // the target of a symlink (so dangling ones and ones to directories
+        // are skipped)
+        if (de->d_type == DT_UNKNOWN || de->d_type == DT_LNK) {
+            struct stat sb;
+            if (fstatat(dirfd(dh), de->d_name, &sb, 0) || !S_ISREG(sb.st_mode))
+                continue;
+        } else if (de->d_type != DT_REG) {
+            continue;
+        }
+
+        if (d->n == d->cap) {
+            d->cap = d->cap ? d->cap * 2 : 64;
+            d->names = realloc(d->names, d->cap * sizeof(char*));
+        }
+        d->names[d->n++] = strdup(de->d_name);
+    }
+    closedir(dh);
+
+    qsort(d->names, d->n, sizeof(char*), nm_generator_dir_cmp);
+
+    NM_LOG("dir: indexed %zu entries matching '%s' in '%s'", d->n, pattern, dir);
+    return true;
+}
+
+// nm_generator_dir_isreg checks if a file (or the target of a symlink) in the
+// directory is a regular file.
+static bool nm_generator_dir_isreg(const char *dir, const char *name) {
+    char path[PATH_MAX];
+    struct stat sb;
+    if (snprintf(path, sizeof(path), "%s/%s", dir, name) >= (int)(sizeof(path)))
+        return false;
+    return !stat(path, &sb) && S_ISREG(sb.st_mode);
+}
+
+// nm_generator_dir_update applies pending inotify events to the index. If the
+// index needs to be rebuilt, false is returned.
+static bool nm_generator_dir_update(nm_generator_dir_t *d, const char *dir, const char *pattern) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    for (;;) {
+        ssize_t n = read(d->fd, buf, sizeof(buf));
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return n == 0 || errno == EAGAIN;
+
+        for (char *p = buf; p < buf + n;) {
+            const struct inotify_event *ev = (const struct inotify_event*)(p);
+            p += sizeof(struct inotify_event) + ev->len;
+
+            if (ev->mask & (IN_Q_OVERFLOW | IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF))
+                return false;
+            if (!ev->len || !nm_generator_dir_match(pattern, ev->name))
+                continue;
+            if ((ev->mask & (IN_CREATE | IN_MOVED_TO)) && nm_generator_dir_isreg(dir, ev->name))
+                nm_generator_dir_add(d, ev->name);
+            else if (ev->mask & (IN_CREATE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM))
+                nm_generator_dir_remove(d, ev->name); // note: this also handles an entry being replaced by something else
+        }
+    }
+}
+
+// nm_generator_dir_quote copies str to p, escaping it for use in a single-quoted
+// sh string (see the $ escape for selection menu substitutions), and returns a
+// pointer to the end.
+static char *nm_generator_dir_quote(char *p, const char *str) {
+    for (const char *c = str; *c; c++) {
+        if (*c == '\'')
+            p = stpcpy(p, "'\"'\"'");
+        else
+            *p++ = *c;
+    }
+    return p;
+}
+
+// nm_generator_dir_cmd returns the malloc'd cmd_spawn argument to run a file.
+static char *nm_generator_dir_cmd(const char *dir, const char *name) {
+    size_t q = 0;
+    for (const char *c = dir; *c; c++)
+        if (*c == '\'')
+            q++;
+    for (const char *c = name; *c; c++)
+        if (*c == '\'')
+            q++;
+
+    char *cmd = malloc(strlen("quiet:exec /bin/sh '/'") + strlen(dir) + strlen(name) + q*4 + 1), *p = cmd;
+    p = stpcpy(p, "quiet:exec /bin/sh '");
+    p = nm_generator_dir_quote(p, dir);
+    p = stpcpy(p, "/");
+    p = nm_generator_dir_quote(p, name);
+    stpcpy(p, "'");
+    return cmd;
+}
+
+NM_GENERATOR_DEPS_(dir) {
+    static char buf[PATH_MAX+1];
+    static const char *deps[] = {buf, NULL};
+    const char *pattern;
+    if (!nm_generator_dir_split(arg, buf, &pattern))
+        return NULL;
+    strcat(buf, "/");
+    return deps;
+}
+
+NM_GENERATOR_PRUNE_(dir) {
+    for (nm_generator_dir_t **p = &nm_generator_dir_all, *d; (d = *p);) {
+        bool used = false;
+        for (size_t i = 0; i < n && !used; i++)
+            used = !strcmp(d->arg, args[i]);
+        if (used) {
+            p = &d->next;
+            continue;
+        }
+        NM_LOG("dir: freeing unused index for '%s'", d->arg);
+        *p = d->next;
+        if (d->fd != -1)
+            close(d->fd);
+        for (size_t i = 0; i < d->n; i++)
+            free(d->names[i]);
+        free(d->names);
+        free(d->arg);
+        free(d);
+    }
+}
+
+NM_GENERATOR_(dir) {
+    char dir[PATH_MAX];
+    const char *pattern;
+    NM_CHECK(NULL, arg && *arg == '/' && nm_generator_dir_split(arg, dir, &pattern), "invalid argument '%s': must be an absolute path to a directory followed by a slash and a filename pattern", arg);
+
+    nm_generator_dir_t *d = nm_generator_dir_all;
+    while (d && strcmp(d->arg, arg))
+        d = d->next;
+
+    if (!d) {
+        d = calloc(1, sizeof(nm_generator_dir_t));
+        d->arg  = strdup(arg);
+        d->fd   = -1;
+        d->next = nm_generator_dir_all;
+        nm_generator_dir_all = d;
+    }
+
+    if (d->fd == -1 || !nm_generator_dir_update(d, dir, pattern))
+        if (!nm_generator_dir_scan(d, dir, pattern))
+            return NULL; // the error will be passed on
+
+    if (!d->changed && (time_in_out->tv_sec || time_in_out->tv_nsec)) {
+        nm_err_set(NULL);
+        return NULL;
+    }
+    d->changed = false;
+
+    clock_gettime(CLOCK_REALTIME, time_in_out);
+
+    if (!d->n) {
+        nm_err_set(NULL);
+        return nm_generator_placeholder("No matching files", "There are no files matching the generator's pattern.", sz_out);
+    }
+
+    size_t n = d->n;
+    if (n > NM_CONFIG_MAX_MENU_ITEMS_PER_MENU) {
+        NM_LOG("dir: only using the first %d of %zu matching files in '%s'", NM_CONFIG_MAX_MENU_ITEMS_PER_MENU, n, dir);
+        n = NM_CONFIG_MAX_MENU_ITEMS_PER_MENU;
+    }
+
+    nm_menu_item_t **items = calloc(n, sizeof(nm_menu_item_t*));
+    for (size_t i = 0; i < n; i++) {
+        items[i] = calloc(1, sizeof(nm_menu_item_t));
+        items[i]->lbl = strdup(d->names[i]);
+        items[i]->action = calloc(1, sizeof(nm_menu_action_t));
+        items[i]->action->act = NM_ACTION(cmd_spawn);
+        items[i]->action->on_failure = true;
+        items[i]->action->on_success = true;
+        items[i]->action->arg = nm_generator_dir_cmd(dir, d->names[i]);
+    }
+
+    *sz_out = n;
+    nm_err_set(NULL);
+    return items;
+}
@@ -0,0 +1,485 @@
+#include <QByteArray>
+#include <QElapsedTimer>
+#include <QProcess>
+#include <QSqlDatabase>
+#include <QSqlError>
+#include <QSqlQuery>
+#include <QString>
+#include <QStringList>
+
+#include <initializer_list>
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "action.h"
+#include "config.h"
+#include "generator.h"
+#include "nickelmenu.h"
+#include "util.h"
+
+// nm_generator_script_t is a long-lived coprocess for the script generator.
+// There is one for each unique argument, and it is kept across config reloads.
+typedef struct nm_generator_script_t {
+    char          *arg;
+    QProcess      *proc;
+    QByteArray    token;   // from the last end line
+    QElapsedTimer listed;  // since the last successful list request
+    bool          changed; // a change notification was received
+    struct nm_generator_script_t *next;
+} nm_generator_script_t;
+
+static nm_generator_script_t *nm_generator_script_all = nullptr; // note: not thread safe
+
+static void nm_generator_script_items_free(nm_menu_item_t **items, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        for (nm_menu_action_t *cur = items[i]->action, *tmp; cur; cur = tmp) {
+            tmp = cur->next;
+            free(cur->arg);
+            free(cur);
+        }
+        free(items[i]->lbl);
+        free(items[i]);
+    }
+    free(items);
+}
+
+// nm_generator_script_action parses <action>:<arg> into a new action. On
+// error, nullptr is returned and nm_err is set.
+static nm_menu_action_t *nm_generator_script_action(char *line, bool on_success, bool on_failure) {
+    char *s_act = strtrim(strsep(&line, ":"));
+    char *p_arg = strtrim(line);
+
+    nm_action_fn_t act = nullptr;
+    if (!s_act || !*s_act) NM_ERR_RET(nullptr, "expected action");
+    #define X(name) \
+    else if (!strcmp(s_act, #name)) act = NM_ACTION(name);
+    NM_ACTIONS
+    #undef X
+    else NM_ERR_RET(nullptr, "unknown action '%s'", s_act);
+
+    if (!p_arg) NM_ERR_RET(nullptr, "expected argument for action '%s'", s_act);
+
+    nm_menu_action_t *a = reinterpret_cast<nm_menu_action_t*>(calloc(1, sizeof(nm_menu_action_t)));
+    a->act        = act;
+    a->arg        = strdup(p_arg);
+    a->on_success = on_success;
+    a->on_failure = on_failure;
+
+    nm_err_set(nullptr);
+    return a;
+}
+
+// nm_generator_script_kill stops the coprocess so it gets restarted the next
+// time (e.g. if it timed out or sent an invalid line in the middle of a reply,
+// the rest of the reply is still pending and the protocol state is unknown).
+static void nm_generator_script_kill(nm_generator_script_t *s) {
+    if (s->proc) {
+        s->proc->kill();
+        s->proc->waitForFinished(100);
+        delete s->proc;
+        s->proc = nullptr;
+    }
+    s->token.clear();
+}
+
+NM_GENERATOR_PRUNE_(script) {
+    for (nm_generator_script_t **p = &nm_generator_script_all, *s; (s = *p);) {
+        bool used = false;
+        for (size_t i = 0; i < n && !used; i++)
+            used = !strcmp(s->arg, args[i]);
+        if (used) {
+            p = &s->next;
+            continue;
+        }
+        NM_LOG("script: stopping unused coprocess for '%s'", s->arg);
+        nm_generator_script_kill(s);
+        *p = s->next;
+        free(s->arg);
+        delete s;
+    }
+}
+
+NM_GENERATOR_(script) {
+    char *tmp = strdupa(arg); // strsep and strtrim will modify it
+    char *s_refresh = strtrim(strsep(&tmp, ":")), *tmp1;
+    char *cmd = strtrim(tmp);
+    long refresh = strtol(s_refresh, &tmp1, 10);
+    NM_CHECK(nullptr, *s_refresh && !*tmp1 && refresh >= 0, "invalid refresh interval '%s': must be a number of seconds, or 0 to only refresh when notified", s_refresh);
+    NM_CHECK(nullptr, cmd && *cmd, "expected command after refresh interval");
+
+    nm_generator_script_t *s = nm_generator_script_all;
+    while (s && strcmp(s->arg, arg))
+        s = s->next;
+
+    if (!s) {
+        s = new nm_generator_script_t();
+        s->arg  = strdup(arg);
+        s->next = nm_generator_script_all;
+        nm_generator_script_all = s;
+    }
+
+    QElapsedTimer deadline;
+    deadline.start();
+
+    if (!s->proc || s->proc->state() != QProcess::Running) {
+        if (s->proc) {
+            NM_LOG("script: coprocess '%s' exited (status %d), restarting", cmd, s->proc->exitCode());
+            nm_generator_script_kill(s);
+        }
+
+        NM_LOG("script: starting coprocess '%s'", cmd);
+        s->proc = new QProcess();
+        s->proc->setWorkingDirectory(QStringLiteral("/"));
+        s->proc->setStandardErrorFile(QStringLiteral("/dev/null"));
+        QObject::connect(s->proc, &QProcess::readyRead, nm_menu_prewarm); // for change notifications (replies only cause a redundant check)
+        s->proc->start(
+            QStringLiteral("/bin/sh"),
+            QStringList(std::initializer_list<QString>{
+                QStringLiteral("-c"),
+                QString::fromUtf8(cmd),
+            }),
+            QIODevice::ReadWrite
+        );
+
+        if (!s->proc->waitForStarted(NM_GENERATOR_TIMEOUT_MS)) {
+            nm_generator_script_kill(s);
+            NM_ERR_RET(nullptr, "could not start coprocess: missing program, wrong permissions, or timed out");
+        }
+
+        s->changed = true;
+        *time_in_out = (struct timespec){0, 0};
+    }
+
+    // check for change notifications without blocking
+    s->proc->waitForReadyRead(0);
+    while (s->proc->canReadLine()) {
+        QByteArray line = s->proc->readLine().trimmed();
+        if (line == "changed")
+            s->changed = true;
+        else
+            NM_LOG("script: ignoring unexpected line from coprocess: %s", line.constData());
+    }
+
+    bool full = !time_in_out->tv_sec && !time_in_out->tv_nsec;
+    if (!full && !s->changed && !(refresh && s->listed.isValid() && s->listed.hasExpired(refresh * 1000))) {
+        nm_err_set(nullptr);
+        return nullptr;
+    }
+
+    QByteArray req = full || s->token.isEmpty()
+        ? QByteArray("list\n")
+        : QByteArray("list ") + s->token + "\n";
+    s->proc->write(req);
+
+    nm_menu_item_t **items = nullptr;
+    size_t items_n = 0;
+
+    for (;;) {
+        while (!s->proc->canReadLine()) {
+            qint64 rem = NM_GENERATOR_TIMEOUT_MS - deadline.elapsed();
+            if (s->proc->state() != QProcess::Running || rem <= 0 || !s->proc->waitForReadyRead(rem)) {
+                bool running = s->proc->state() == QProcess::Running;
+                nm_generator_script_items_free(items, items_n);
+                nm_generator_script_kill(s);
+                if (running)
+                    NM_ERR_RET(nullptr, "timed out waiting for coprocess reply");
+                NM_ERR_RET(nullptr, "coprocess exited while listing items");
+            }
+        }
+
+        QByteArray buf = s->proc->readLine();
+        if (buf.endsWith('\n'))
+            buf.chop(1);
+        char *line = buf.data();
+        char *s_typ = strtrim(strsep(&line, ":"));
+
+        if (!strcmp(s_typ, "changed")) {
+            continue; // we're already listing
+        } else if (!strcmp(s_typ, "unchanged")) {
+            if (full) {
+                nm_generator_script_items_free(items, items_n);
+                nm_generator_script_kill(s);
+                NM_ERR_RET(nullptr, "coprocess: replied unchanged to a full list request");
+            }
+            s->changed = false;
+            s->listed.start();
+            nm_generator_script_items_free(items, items_n);
+            nm_err_set(nullptr);
+            return nullptr;
+        } else if (!strcmp(s_typ, "error")) {
+            nm_generator_script_items_free(items, items_n);
+            NM_ERR_RET(nullptr, "coprocess: %s", line ? strtrim(line) : "unknown error");
+        } else if (!strcmp(s_typ, "end")) {
+            s->token   = QByteArray(line ? strtrim(line) : "");
+            s->changed = false;
+            s->listed.start();
+            break;
+        } else if (!strcmp(s_typ, "item")) {
+            char *p_lbl = strtrim(strsep(&line, ":"));
+            if (!p_lbl || !line) {
+                nm_generator_script_items_free(items, items_n);
+                nm_generator_script_kill(s);
+                NM_ERR_RET(nullptr, "coprocess: item %zu: expected label, action, and argument", items_n+1);
+            }
+            if (items_n == NM_CONFIG_MAX_MENU_ITEMS_PER_MENU) {
+                nm_generator_script_items_free(items, items_n);
+                nm_generator_script_kill(s);
+                NM_ERR_RET(nullptr, "coprocess: too many items (> %d)", NM_CONFIG_MAX_MENU_ITEMS_PER_MENU);
+            }
+
+            nm_menu_action_t *act = nm_generator_script_action(line, true, true);
+            if (!act) {
+                nm_generator_script_items_free(items, items_n);
+                nm_generator_script_kill(s);
+                NM_ERR_RET(nullptr, "coprocess: item %zu: %s", items_n+1, nm_err());
+            }
+
+            items = reinterpret_cast<nm_menu_item_t**>(realloc(items, (items_n+1) * sizeof(nm_menu_item_t*)));
+            items[items_n] = reinterpret_cast<nm_menu_item_t*>(calloc(1, sizeof(nm_menu_item_t)));
+            items[items_n]->lbl    = strdup(p_lbl);
+            items[items_n]->action = act;
+            items_n++;
+        } else if (!strncmp(s_typ, "chain_", 6)) {
+            bool p_on_success = !strcmp(s_typ, "chain_success") || !strcmp(s_typ, "chain_always");
+            bool p_on_failure = !strcmp(s_typ, "chain_failure") || !strcmp(s_typ, "chain_always");
+            if (!items_n || !(p_on_success || p_on_failure) || !line) {
+                nm_generator_script_items_free(items, items_n);
+                nm_generator_script_kill(s);
+                NM_ERR_RET(nullptr, "coprocess: unexpected '%s' line", s_typ);
+            }
+
+            nm_menu_action_t *act = nm_generator_script_action(line, p_on_success, p_on_failure);
+            if (!act) {
+                nm_generator_script_items_free(items, items_n);
+                nm_generator_script_kill(s);
+                NM_ERR_RET(nullptr, "coprocess: item %zu: %s", items_n, nm_err());
+            }
+
+            nm_menu_action_t *cur = items[items_n-1]->action;
+            while (cur->next)
+                cur = cur->next;
+            cur->next = act;
+        } else {
+            nm_generator_script_items_free(items, items_n);
+            nm_generator_script_kill(s);
+            NM_ERR_RET(nullptr, "coprocess: unexpected reply line type '%s'", s_typ);
+        }
+    }
+
+    NM_LOG("script: coprocess returned %zu items (token: %s)", items_n, s->token.constData());
+
+    clock_gettime(CLOCK_REALTIME, time_in_out);
+
+    if (!items_n) {
+        free(items);
+        nm_err_set(nullptr);
+        return nm_generator_placeholder("No items", "The script did not list any items.", sz_out);
+    }
+
+    *sz_out = items_n;
+    nm_err_set(nullptr);
+    return items;
+}
+
+#ifndef NM_GENERATOR_LIBRARY_DB
+#define NM_GENERATOR_LIBRARY_DB "/mnt/onboard/.kobo/KoboReader.sqlite"
+#endif
+
+// note: the connection and prepared statements are kept across runs, and are
+// only reset if a query fails (not thread safe, but neither is QSqlDatabase)
+static const char *nm_generator_library_conn    = "nm_generator_library";
+static QSqlQuery  *nm_generator_library_recent  = nullptr;
+static QSqlQuery  *nm_generator_library_shelves = nullptr;
+
+static void nm_generator_library_close() {
+    delete nm_generator_library_recent;
+    delete nm_generator_library_shelves;
+    nm_generator_library_recent = nullptr;
+    nm_generator_library_shelves = nullptr;
+    QSqlDatabase::removeDatabase(QString::fromLatin1(nm_generator_library_conn));
+}
+
+// nm_generator_library_query returns the cached prepared statement for the
+// specified kind, opening the database if needed. On error, nullptr is returned
+// and nm_err is set.
+static QSqlQuery *nm_generator_library_query(bool shelves) {
+    QString conn = QString::fromLatin1(nm_generator_library_conn);
+    QSqlDatabase db = QSqlDatabase::contains(conn)
+        ? QSqlDatabase::database(conn, false)
+        : QSqlDatabase::addDatabase(QStringLiteral("QSQLITE"), conn);
+
+    if (!db.isOpen()) {
+        db.setDatabaseName(QStringLiteral(NM_GENERATOR_LIBRARY_DB));
+        // Nickel uses WAL mode, so a read-only connection never blocks its
+        // writers, but a checkpoint can briefly block us, so limit the wait to
+        // part of the generator deadline.
+        db.setConnectOptions(QStringLiteral("QSQLITE_OPEN_READONLY;QSQLITE_BUSY_TIMEOUT=%1").arg(NM_GENERATOR_TIMEOUT_MS/4));
+        if (!db.open()) {
+            QByteArray err = db.lastError().text().toUtf8();
+            NM_ERR_RET(nullptr, "could not open '%s': %s", NM_GENERATOR_LIBRARY_DB, err.constData());
+        }
+        NM_LOG("library: opened '%s' read-only", NM_GENERATOR_LIBRARY_DB);
+    }
+
+    QSqlQuery **q = shelves ? &nm_generator_library_shelves : &nm_generator_library_recent;
+    if (!*q) {
+        *q = new QSqlQuery(db);
+        (*q)->setForwardOnly(true);
+        bool ok = shelves
+            ? (*q)->prepare(QStringLiteral(
+                "SELECT COALESCE(NULLIF(Name, ''), InternalName), NULL FROM Shelf "
+                "WHERE _IsDeleted IS NOT 'true' ORDER BY LastModified DESC LIMIT ?"))
+            : (*q)->prepare(QStringLiteral(
+                "SELECT ContentID, Title FROM content "
+                "WHERE ContentType = 6 AND DateLastRead IS NOT NULL AND DateLastRead != '' "
+                "ORDER BY DateLastRead DESC LIMIT ?"));
+        if (!ok) {
+            QByteArray err = (*q)->lastError().text().toUtf8();
+            delete *q;
+            *q = nullptr;
+            NM_ERR_RET(nullptr, "could not prepare query: %s", err.constData());
+        }
+    }
+
+    nm_err_set(nullptr);
+    return *q;
+}
+
+NM_GENERATOR_(library) {
+    char *tmp = strdupa(arg); // strsep and strtrim will modify it
+    char *s_kind  = strtrim(strsep(&tmp, ":"));
+    char *s_limit = strtrim(strsep(&tmp, ":")), *tmp1;
+    NM_CHECK(nullptr, s_kind && (!strcmp(s_kind, "recent") || !strcmp(s_kind, "shelves")), "invalid kind '%s': must be recent or shelves", s_kind ? s_kind : "");
+    NM_CHECK(nullptr, s_limit && tmp, "expected limit, action, and argument after kind");
+    long limit = strtol(s_limit, &tmp1, 10);
+    NM_CHECK(nullptr, *s_limit && !*tmp1 && limit >= 1 && limit <= NM_CONFIG_MAX_MENU_ITEMS_PER_MENU, "invalid limit '%s': must be between 1 and %d", s_limit, NM_CONFIG_MAX_MENU_ITEMS_PER_MENU);
+
+    // the action template is parsed first so errors are reported before the
+    // database is touched
+    nm_menu_action_t *tpl = nm_generator_script_action(tmp, true, true);
+    if (!tpl)
+        return nullptr; // the error will be passed on
+
+    // Nickel's writes go to the WAL first, so both need to be checked (this is
+    // also much cheaper than even a trivial query)
+    struct stat sb;
+    if (stat(NM_GENERATOR_LIBRARY_DB, &sb)) {
+        free(tpl->arg);
+        free(tpl);
+        NM_ERR_RET(nullptr, "error checking '%s': stat: %m", NM_GENERATOR_LIBRARY_DB);
+    }
+    struct timespec mtime = sb.st_mtim;
+    if (!stat(NM_GENERATOR_LIBRARY_DB "-wal", &sb) && (sb.st_mtim.tv_sec > mtime.tv_sec || (sb.st_mtim.tv_sec == mtime.tv_sec && sb.st_mtim.tv_nsec > mtime.tv_nsec)))
+        mtime = sb.st_mtim;
+
+    if (time_in_out->tv_sec == mtime.tv_sec && time_in_out->tv_nsec == mtime.tv_nsec) {
+        free(tpl->arg);
+        free(tpl);
+        nm_err_set(nullptr);
+        return nullptr;
+    }
+
+    bool shelves = !strcmp(s_kind, "shelves");
+    QSqlQuery *q = nm_generator_library_query(shelves);
+    if (!q) {
+        free(tpl->arg);
+        free(tpl);
+        return nullptr; // the error will be passed on
+    }
+
+    q->addBindValue(static_cast<int>(limit));
+    if (!q->exec()) {
+        QByteArray err = q->lastError().text().toUtf8();
+        free(tpl->arg);
+        free(tpl);
+        nm_generator_library_close(); // in case the database was replaced
+        NM_ERR_RET(nullptr, "could not query library: %s", err.constData());
+    }
+
+    nm_menu_item_t **items = nullptr;
+    size_t items_n = 0;
+
+    // for the command actions, {} is meant to be used in a single-quoted sh
+    // string, so escape it (see the $ escape for selection menu substitutions)
+    bool quote = tpl->act == NM_ACTION(cmd_spawn) || tpl->act == NM_ACTION(cmd_output);
+
+    QByteArray placeholder("{}");
+    while (q->next() && items_n < static_cast<size_t>(limit)) {
+        QByteArray val = q->value(0).toString().toUtf8();
+        QByteArray lbl = q->value(1).toString().toUtf8();
+        if (val.isEmpty())
+            continue;
+        if (lbl.isEmpty())
+            lbl = shelves ? val : val.mid(val.lastIndexOf('/') + 1);
+        if (quote)
+            val.replace('\'', "'\"'\"'");
+
+        items = reinterpret_cast<nm_menu_item_t**>(realloc(items, (items_n+1) * sizeof(nm_menu_item_t*)));
+        items[items_n] = reinterpret_cast<nm_menu_item_t*>(calloc(1, sizeof(nm_menu_item_t)));
+        items[items_n]->lbl    = strdup(lbl.constData());
+        items[items_n]->action = reinterpret_cast<nm_menu_action_t*>(calloc(1, sizeof(nm_menu_action_t)));
+        items[items_n]->action->act        = tpl->act;
+        items[items_n]->action->arg        = strdup(QByteArray(tpl->arg).replace(placeholder, val).constData());
+        items[items_n]->action->on_success = true;
+        items[items_n]->action->on_failure = true;
+        items_n++;
+    }
+
+    // don't hold the read transaction open until the next run, or Nickel won't
+    // be able to checkpoint the WAL
+    q->finish();
+
+    free(tpl->arg);
+    free(tpl);
+
+    NM_LOG("library: %s returned %zu items", s_kind, items_n);
+
+    *time_in_out = mtime;
+    nm_err_set(nullptr);
+
+    if (!items_n) {
+        free(items);
+        return shelves
+            ? nm_generator_placeholder("No collections", "There are no collections in the library.", sz_out)
+            : nm_generator_placeholder("No recent books", "No books have been opened yet.", sz_out);
+    }
+
+    *sz_out = items_n;
+    return items;
+}
+
+NM_GENERATOR_DEPS_(library) {
+    (void) arg;
+    static const char *const deps[] = {NM_GENERATOR_LIBRARY_DB, NM_GENERATOR_LIBRARY_DB "-wal", nullptr};
+    return deps;
+}
+
+extern "C" int nm_generator_library_current(char **id_out, char **title_out) {
+    QSqlQuery *q = nm_generator_library_query(false);
+    if (!q)
+        return -1; // the error will be passed on
+
+    q->addBindValue(1);
+    if (!q->exec()) {
+        QByteArray err = q->lastError().text().toUtf8();
+        nm_generator_library_close(); // in case the database was replaced
+        NM_ERR_RET(-1, "could not query library: %s", err.constData());
+    }
+
+    if (!q->next()) {
+        q->finish();
+        NM_ERR_RET(-1, "no book has been opened");
+    }
+
+    *id_out    = strdup(q->value(0).toString().toUtf8().constData());
+    *title_out = strdup(q->value(1).toString().toUtf8().constData());
+    q->finish();
+
+    nm_err_set(nullptr);
+    return 0;
+}
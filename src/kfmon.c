@@ -2,63 +2,149 @@
 #include <errno.h>
 #include <linux/limits.h>
 #include <poll.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "kfmon.h"
 #include "kfmon_helpers.h"
 #include "util.h"
 
-// Free all resources allocated by a list and its nodes
+// Free all resources allocated by a list
 inline void kfmon_teardown_list(kfmon_watch_list_t *list) {
-    kfmon_watch_node_t *node = list->head;
-    while (node) {
-        kfmon_watch_node_t *p = node->next;
-        free(node->watch.filename);
-        free(node->watch.label);
-        free(node);
-        node = p;
-    }
+    free(list->watches);
+    free(list->strings);
     // Don't leave dangling pointers
-    list->head = NULL;
-    list->tail = NULL;
+    *list = (kfmon_watch_list_t){ 0 };
 }
 
-// Allocate a single new node to the list
-inline int kfmon_grow_list(kfmon_watch_list_t *list) {
-    kfmon_watch_node_t *prev = list->tail;
-    kfmon_watch_node_t *node = calloc(1, sizeof(*node));
-    if (!node) {
-        return KFMON_IPC_CALLOC_FAILURE;
+// Append a NUL-terminated string to the strings of a list, and store its offset by ref
+static int kfmon_list_intern(kfmon_watch_list_t *list, const char *str, uint32_t *off_out) {
+    size_t len = strlen(str) + 1U;
+    if (list->strings_cap - list->strings_len < len) {
+        size_t cap = list->strings_cap ? list->strings_cap * 2 : 1024;
+        while (cap - list->strings_len < len) {
+            cap *= 2;
+        }
+        if (cap > UINT32_MAX) {
+            return KFMON_IPC_CALLOC_FAILURE;
+        }
+        char *strings = realloc(list->strings, cap);
+        if (!strings) {
+            return KFMON_IPC_CALLOC_FAILURE;
+        }
+        list->strings     = strings;
+        list->strings_cap = cap;
     }
-    list->count++;
+    memcpy(list->strings + list->strings_len, str, len);
+    *off_out = (uint32_t) list->strings_len;
+    list->strings_len += len;
+    return EXIT_SUCCESS;
+}
 
-    // Update the head if this is the first node
-    if (!list->head) {
-        list->head = node;
+// Append a single watch to the list
+inline int kfmon_grow_list(kfmon_watch_list_t *list, uint8_t idx, const char *filename, const char *label) {
+    if (list->count == list->cap) {
+        size_t cap = list->cap ? list->cap * 2 : 16;
+        kfmon_watch_t *watches = realloc(list->watches, cap * sizeof(*watches));
+        if (!watches) {
+            return KFMON_IPC_CALLOC_FAILURE;
+        }
+        list->watches = watches;
+        list->cap     = cap;
     }
-    // Update the tail pointer
-    list->tail = node;
-    // If there was a previous node, link the two together
-    if (prev) {
-        prev->next = node;
+
+    kfmon_watch_t *watch = &list->watches[list->count];
+    watch->idx = idx;
+    if (kfmon_list_intern(list, filename, &watch->filename) != EXIT_SUCCESS) {
+        return KFMON_IPC_CALLOC_FAILURE;
     }
+    // Watches without a label use the filename, so don't store it twice
+    if (!label) {
+        watch->label = watch->filename;
+    } else if (kfmon_list_intern(list, label, &watch->label) != EXIT_SUCCESS) {
+        return KFMON_IPC_CALLOC_FAILURE;
+    }
+    list->count++;
 
     return EXIT_SUCCESS;
 }
 
+// Parser state for the reply to a simple command.
+typedef struct {
+    char buf[32];  // enough for the longest reply
+    size_t len;
+    bool notified; // whether we got a notification before it
+} kfmon_reply_parser_t;
+
+// The simple replies KFMon can send (those match the actual string sent over the wire)
+static const struct {
+    const char *str;
+    int status;
+} kfmon_replies[] = {
+    { "OK",                       EXIT_SUCCESS },
+    { "ERR_INVALID_ID",           KFMON_IPC_ERR_INVALID_ID },
+    { "WARN_ALREADY_RUNNING",     KFMON_IPC_WARN_ALREADY_RUNNING },
+    { "WARN_SPAWN_BLOCKED",       KFMON_IPC_WARN_SPAWN_BLOCKED },
+    { "WARN_SPAWN_INHIBITED",     KFMON_IPC_WARN_SPAWN_INHIBITED },
+    { "ERR_REALLY_MALFORMED_CMD", KFMON_IPC_ERR_REALLY_MALFORMED_CMD },
+    { "ERR_MALFORMED_CMD",        KFMON_IPC_ERR_MALFORMED_CMD },
+    { "ERR_INVALID_CMD",          KFMON_IPC_ERR_INVALID_CMD },
+    { "NOTIFY_LIST_CHANGED",      KFMON_IPC_NOTIFY_LIST_CHANGED },
+};
+
+// Match the start of a (possibly partial) reply against the simple replies. Returns the status for a complete one,
+// KFMON_IPC_EAGAIN if it could still become one once we've read more, or KFMON_IPC_UNKNOWN_REPLY if it can't.
+static int match_reply(const char *buf, size_t len) {
+    bool partial = false;
+    for (size_t i = 0; i < sizeof(kfmon_replies) / sizeof(*kfmon_replies); i++) {
+        // NOTE: KFMon sends the NUL too, and we need to consume it before we're done, or it'd end up in front of the
+        //       next reply.
+        size_t n = strlen(kfmon_replies[i].str) + 1U;
+        if (!memcmp(buf, kfmon_replies[i].str, len < n ? len : n)) {
+            if (len >= n) {
+                return kfmon_replies[i].status;
+            }
+            partial = true;
+        }
+    }
+    return partial ? KFMON_IPC_EAGAIN : KFMON_IPC_UNKNOWN_REPLY;
+}
+
+// Match the start of a (possibly partial) reply like match_reply, but skip over any notifications in front of it (which
+// KFMon may send at any time if we're subscribed), and note them in notified_out. len_io is updated accordingly.
+static int match_reply_skip_notify(char *buf, size_t *len_io, bool *notified_out) {
+    int reply;
+    while ((reply = match_reply(buf, *len_io)) == KFMON_IPC_NOTIFY_LIST_CHANGED) {
+        size_t n = sizeof("NOTIFY_LIST_CHANGED");
+        memmove(buf, buf + n, *len_io - n);
+        *len_io -= n;
+        *notified_out = true;
+    }
+    // Nothing left (yet)?
+    if (!*len_io) {
+        return KFMON_IPC_EAGAIN;
+    }
+    return reply;
+}
+
 // Handle replies from the IPC socket
-static int handle_reply(int data_fd, void *data __attribute__((unused))) {
-    // Eh, recycle PIPE_BUF, it should be more than enough for our needs.
-    char buf[PIPE_BUF] = { 0 };
+static int handle_reply(int data_fd, void *data) {
+    kfmon_reply_parser_t *parser = (kfmon_reply_parser_t*) data;
 
-    // We don't actually know the size of the reply, so, best effort here.
-    ssize_t len = xread(data_fd, buf, sizeof(buf));
+    // NOTE: The reply is tiny, but may still be split across multiple reads, so we keep what we've got so far.
+    //       If there's more than the longest reply, it can't be one of them anyway.
+    if (parser->len == sizeof(parser->buf)) {
+        return KFMON_IPC_UNKNOWN_REPLY;
+    }
+    ssize_t len = xread(data_fd, parser->buf + parser->len, sizeof(parser->buf) - parser->len);
     if (len < 0) {
         // Only actual failures are left, xread handles the rest
         return KFMON_IPC_REPLY_READ_FAILURE;
@@ -68,135 +154,141 @@ static int handle_reply(int data_fd, void *data __attribute__((unused))) {
     if (len == 0) {
         return KFMON_IPC_ENODATA;
     }
+    parser->len += (size_t) len;
 
-    // Check the reply for failures
-    if (!strncmp(buf, "ERR_INVALID_ID", 14)) {
-        return KFMON_IPC_ERR_INVALID_ID;
-    } else if (!strncmp(buf, "WARN_ALREADY_RUNNING", 20)) {
-        return KFMON_IPC_WARN_ALREADY_RUNNING;
-    } else if (!strncmp(buf, "WARN_SPAWN_BLOCKED", 18)) {
-        return KFMON_IPC_WARN_SPAWN_BLOCKED;
-    } else if (!strncmp(buf, "WARN_SPAWN_INHIBITED", 20)) {
-        return KFMON_IPC_WARN_SPAWN_INHIBITED;
-    } else if (!strncmp(buf, "ERR_REALLY_MALFORMED_CMD", 24)) {
-        return KFMON_IPC_ERR_REALLY_MALFORMED_CMD;
-    } else if (!strncmp(buf, "ERR_MALFORMED_CMD", 17)) {
-        return KFMON_IPC_ERR_MALFORMED_CMD;
-    } else if (!strncmp(buf, "ERR_INVALID_CMD", 15)) {
-        return KFMON_IPC_ERR_INVALID_CMD;
-    } else if (!strncmp(buf, "OK", 2)) {
-        return EXIT_SUCCESS;
-    } else {
-        return KFMON_IPC_UNKNOWN_REPLY;
+    // Check the reply for failures (we're not done until we've got a reply we're satisfied with...)
+    return match_reply_skip_notify(parser->buf, &parser->len, &parser->notified);
+}
+
+// Incremental parser state for the reply to a 'list' command, which may be split across any number of reads.
+typedef struct {
+    kfmon_watch_list_t *list;
+    char *buf;     // unparsed bytes (i.e., at most a partial record) followed by the latest read
+    size_t len;    // number of bytes in buf
+    size_t cap;    // allocated size of buf
+    bool replied;  // whether we've already got (and checked) the start of the reply
+    bool notified; // whether we got a notification before it
+} kfmon_list_parser_t;
+
+// Parse a single complete id:filename:label (or id:filename for watches without a label) record, which is NUL-terminated.
+static int parse_list_record(kfmon_watch_list_t *list, char *line) {
+    NM_LOG("Parsing reply line: `%s`", line);
+
+    // NOTE: We don't care about id, as it potentially won't be stable across the full powercycle,
+    //       filename is what we pass verbatim to a kfmon action
+    //       label is our action's lbl (use filename if NULL)
+    char *filename = strchr(line, ':');
+    if (!filename) {
+        return KFMON_IPC_LIST_PARSE_FAILURE;
+    }
+    *filename++ = '\0';
+
+    // Final separator is optional, if it's not there, there's no label, use the filename instead.
+    char *label = strchr(filename, ':');
+    if (label) {
+        *label++ = '\0';
+        char *end = strchr(label, ':');
+        if (end) {
+            *end = '\0';
+        }
     }
 
-    // We're not done until we've got a reply we're satisfied with...
-    return KFMON_IPC_EAGAIN;
+    return kfmon_grow_list(list, (uint8_t) strtoul(line, NULL, 10), filename, label);
 }
 
 // Handle replies from a 'list' command
 static int handle_list_reply(int data_fd, void *data) {
-    // Can't do it on the stack because of strsep
-    char *buf = NULL;
-    buf = calloc(PIPE_BUF, sizeof(*buf));
-    if (!buf) {
-        return KFMON_IPC_CALLOC_FAILURE;
+    kfmon_list_parser_t *parser = (kfmon_list_parser_t*) data;
+
+    // Make sure there's room for a full read (and a NUL) after whatever is left over from the last one. The buffer only
+    // ever holds a single partial record on top of that, so it won't grow much, even for huge lists.
+    if (parser->cap - parser->len < PIPE_BUF + 1) {
+        size_t cap = parser->cap ? parser->cap * 2 : PIPE_BUF * 2;
+        while (cap - parser->len < PIPE_BUF + 1) {
+            cap *= 2;
+        }
+        char *buf = realloc(parser->buf, cap);
+        if (!buf) {
+            return KFMON_IPC_CALLOC_FAILURE;
+        }
+        parser->buf = buf;
+        parser->cap = cap;
     }
 
-    // Until proven otherwise...
-    int status = EXIT_SUCCESS;
-
     // We don't actually know the size of the reply, so, best effort here.
-    ssize_t len = xread(data_fd, buf, PIPE_BUF);
+    ssize_t len = xread(data_fd, parser->buf + parser->len, PIPE_BUF);
     if (len < 0) {
         // Only actual failures are left, xread handles the rest
-        status = KFMON_IPC_REPLY_READ_FAILURE;
-        goto cleanup;
+        return KFMON_IPC_REPLY_READ_FAILURE;
     }
 
     // If there's actually nothing to read (EoF), abort.
     if (len == 0) {
-        status = KFMON_IPC_ENODATA;
-        goto cleanup;
+        return KFMON_IPC_ENODATA;
     }
 
+    // Keep some minimal debug logging around, just in case...
+    NM_LOG("Got a %zd bytes reply from KFMon (%zu bytes left over from the last one)", len, parser->len);
+    parser->buf[parser->len + (size_t) len] = '\0';
+
     // The only valid reply for list is... a list ;).
-    if (!strncmp(buf, "ERR_INVALID_CMD", 15)) {
-        status = KFMON_IPC_ERR_INVALID_CMD;
-        goto cleanup;
-    } else if ((!strncmp(buf, "WARN_", 5)) ||
-               (!strncmp(buf, "ERR_", 4)) ||
-               (!strncmp(buf, "OK", 2))) {
-        status = KFMON_IPC_UNKNOWN_REPLY;
-        goto cleanup;
-    }
-
-    // NOTE: Replies may be split across multiple reads (and as such, multiple handle_list_reply calls).
-    //       So the only way we can be sure that we're done (short of timing out after a while of no POLLIN revents,
-    //       which would be stupid), is to check that the final byte we've just read is a NUL,
-    //       as that's how KFMon terminates a list.
-    bool eot = false;
-    // NOTE: The parsing code later does its own take on this to detect the final line,
-    //       but this one should be authoritative, as strsep modifies the data.
-    if (buf[len - 1] == '\0') {
-        eot = true;
+    // NOTE: This only needs to be checked at the start of the reply, but we might not have all of it yet.
+    if (!parser->replied) {
+        parser->len += (size_t) len;
+        len = 0;
+        int reply = match_reply_skip_notify(parser->buf, &parser->len, &parser->notified);
+        parser->buf[parser->len] = '\0';
+        if (reply == KFMON_IPC_EAGAIN) {
+            return KFMON_IPC_EAGAIN;
+        } else if (reply == KFMON_IPC_ERR_INVALID_CMD) {
+            return KFMON_IPC_ERR_INVALID_CMD;
+        } else if (reply != KFMON_IPC_UNKNOWN_REPLY) {
+            return KFMON_IPC_UNKNOWN_REPLY;
+        }
+        parser->replied = true;
+        // The whole buffer needs to be parsed now
+        len += (ssize_t) parser->len;
+        parser->len = 0;
     }
 
-    // Keep some minimal debug logging around, just in case...
-    NM_LOG("Got a %zd bytes reply from KFMon (%s an EoT marker)", len, eot ? "with" : "*without*");
-    // Now that we're sure we didn't get a wonky reply from an unrelated command, parse the list
-    // NOTE: Format is:
-    //       id:filename:label or id:filename for watches without a label
-    //       We don't care about id, as it potentially won't be stable across the full powercycle,
-    //       filename is what we pass verbatim to a kfmon action
-    //       label is our action's lbl (use filename if NULL)
-    char *p = buf;
-    char *line = NULL;
-    // Break the reply line by line
-    while ((line = strsep(&p, "\n")) != NULL) {
-        // Then parse each line...
-        // If it's the final line, its only content is a single NUL
-        if (*line == '\0') {
-            // NOTE: This might also simply be the end of a single-line read,
-            //       in which case the NUL is thanks to calloc...
-            break;
-        }
-        NM_LOG("Parsing reply line: `%s`", line);
-        // NOTE: Simple syslog logging for now
-        char *watch_idx = strsep(&line, ":");
-        if (!watch_idx) {
-            status = KFMON_IPC_LIST_PARSE_FAILURE;
-            goto cleanup;
+    // Parse every complete record (terminated by a LF, or the NUL which KFMon uses to terminate the list), and keep
+    // the rest for the next read. Only the new bytes need to be scanned, as the leftover doesn't contain a terminator.
+    char *start = parser->buf;
+    char *cur   = parser->buf + parser->len;
+    char *end   = parser->buf + parser->len + len;
+    for (; cur < end; cur++) {
+        if (*cur != '\n' && *cur != '\0') {
+            continue;
         }
-        char *filename = strsep(&line, ":");
-        if (!filename) {
-            status = KFMON_IPC_LIST_PARSE_FAILURE;
-            goto cleanup;
-        }
-        // Final separator is optional, if it's not there, there's no label, use the filename instead.
-        char *label = strsep(&line, ":");
 
-        // Store that at the tail of the list
-        kfmon_watch_list_t *list = (kfmon_watch_list_t*) data;
-        // Make room for a new node
-        if (kfmon_grow_list(list) != EXIT_SUCCESS) {
-            status = KFMON_IPC_CALLOC_FAILURE;
-            goto cleanup;
+        bool eot = *cur == '\0';
+        *cur = '\0';
+
+        // Skip empty lines (e.g., the one before the final NUL)
+        if (cur != start) {
+            int status = parse_list_record(parser->list, start);
+            if (status != EXIT_SUCCESS) {
+                return status;
+            }
         }
-        // Use it
-        kfmon_watch_node_t *node = list->tail;
+        start = cur + 1;
 
-        node->watch.idx = (uint8_t) strtoul(watch_idx, NULL, 10);
-        node->watch.filename = strdup(filename);
-        node->watch.label = label ? strdup(label) : strdup(filename);
+        // We're done once we've got the NUL (anything after it isn't ours)
+        if (eot) {
+            if (cur + 1 != end) {
+                NM_LOG("Ignoring %td bytes after the end of the list", end - (cur + 1));
+            }
+            parser->len = 0;
+            return EXIT_SUCCESS;
+        }
     }
 
-    // Are we really done?
-    status = eot ? EXIT_SUCCESS : KFMON_IPC_EAGAIN;
+    // Move the partial record (if any) to the start of the buffer
+    parser->len = (size_t) (end - start);
+    memmove(parser->buf, start, parser->len);
 
-cleanup:
-    free(buf);
-    return status;
+    // We're not done until we've got the NUL
+    return KFMON_IPC_EAGAIN;
 }
 
 // Connect to KFMon's IPC socket. Returns error code, store data fd by ref.
@@ -237,160 +329,545 @@ static int send_packet(int data_fd, const char *restrict payload, size_t len) {
     return EXIT_SUCCESS;
 }
 
-// Send the requested IPC command:arg pair (or command alone if arg is NULL)
-static int send_ipc_command(int data_fd, const char *restrict ipc_cmd, const char *restrict ipc_arg) {
-    char buf[256] = { 0 };
-    int packet_len = 0;
-    // Somme commands don't require an arg
-    if (ipc_arg) {
-        packet_len = snprintf(buf, sizeof(buf), "%s:%s", ipc_cmd, ipc_arg);
-    } else {
-        packet_len = snprintf(buf, sizeof(buf), "%s", ipc_cmd);
+// A request queued on the session
+typedef struct kfmon_request {
+    char packet[256];            // the NUL-terminated command:arg pair
+    size_t packet_len;           // including the NUL
+    kfmon_watch_list_t *list;    // NULL if the reply is only used for its diagnostic value
+    kfmon_list_parser_t parser;  // for list replies
+    kfmon_reply_parser_t reply;  // for other replies
+    int *status_out;             // set once the request completes
+    kfmon_async_cb_t cb;         // if not NULL, called after the request completes (done is never set)
+    void *ctx;
+    bool done;                   // set once the request completes, for synchronous requests
+    bool sent;                   // whether the packet was sent on the current connection
+    bool fresh;                  // whether the current connection was made for this request
+    bool subscribe;              // whether this is the request subscribing the session to notifications
+    int attempt;
+    struct timespec deadline;    // when to give up waiting for (more of) the reply
+    struct kfmon_request *next;
+} kfmon_request_t;
+
+// Used as the callback for all but the last request of an asynchronous batch
+static void kfmon_async_noop(void *ctx __attribute__((unused))) {}
+
+// The state of the subscription to list change notifications on the current connection
+typedef enum {
+    KFMON_SUB_NONE,     // not subscribed yet
+    KFMON_SUB_PENDING,  // the subscribe request is queued
+    KFMON_SUB_ACTIVE,   // subscribed
+    KFMON_SUB_INACTIVE, // not supported by KFMon (or it failed), don't try again until we reconnect
+} kfmon_sub_e;
+
+// The persistent session with KFMon, and the queue serializing requests on it so replies from concurrent callers can't
+// interleave. Requests are served in the order they were queued, and any caller waiting for a reply (or the event loop,
+// for asynchronous ones) makes progress on the whole queue.
+static struct {
+    pthread_mutex_t lock;
+    int             fd;    // -1 if not connected
+    kfmon_request_t *head; // the request currently being handled
+    kfmon_request_t *tail;
+    // NOTE: KFMon only handles a single client at a time, so notifications have to share the session with requests.
+    kfmon_sub_e          sub;
+    kfmon_async_cb_t     sub_cb;   // NULL if not subscribed
+    void                 *sub_ctx;
+    bool                 notified; // whether there's a notification we haven't passed on to sub_cb yet
+    kfmon_reply_parser_t idle;     // for anything sent while we aren't waiting on a reply
+} kfmon_session = { PTHREAD_MUTEX_INITIALIZER, -1, NULL, NULL, KFMON_SUB_NONE, NULL, NULL, false, { { 0 }, 0, false } };
+
+// Close the session, preserving errno for the error handler
+static void kfmon_session_close(void) {
+    if (kfmon_session.fd != -1) {
+        int err = errno;
+        close(kfmon_session.fd);
+        errno = err;
+        kfmon_session.fd = -1;
     }
-    // Send it (w/ a NUL)
-    return send_packet(data_fd, buf, (size_t) (packet_len + 1));
+    if (kfmon_session.sub == KFMON_SUB_ACTIVE) {
+        kfmon_session.sub = KFMON_SUB_NONE;
+    }
+    kfmon_session.idle.len = 0;
 }
 
-// Poll the IPC socket for potentially *multiple* replies to a single command, timeout after attempts * timeout (ms)
-static int wait_for_replies(int data_fd, int timeout, size_t attempts, ipc_handler_t reply_handler, void **data) {
-    int status = EXIT_SUCCESS;
-
+// Check whether the session is still usable without blocking, handling anything sent while we weren't waiting on a
+// reply: notifications are noted, and anything else (e.g., a late reply after a timeout) is discarded. Returns false if
+// KFMon hung up (e.g., it was restarted or dropped an idle client).
+static bool kfmon_session_alive(int data_fd) {
     struct pollfd pfd = { 0 };
-    // Data socket
-    pfd.fd     = data_fd;
-    pfd.events = POLLIN;
+    pfd.fd            = data_fd;
+    pfd.events        = POLLIN;
 
-    // Here goes... We'll wait for <attempts> windows of <timeout>ms
-    size_t retry = 0U;
     while (1) {
-        int poll_num = poll(&pfd, 1, timeout);
+        int poll_num = poll(&pfd, 1, 0);
         if (poll_num == -1) {
             if (errno == EINTR) {
                 continue;
             }
+            return false;
+        }
+        if (poll_num == 0) {
+            return true;
+        }
+        if (!(pfd.revents & POLLIN)) {
+            return false;
+        }
+
+        kfmon_reply_parser_t *idle = &kfmon_session.idle;
+        int reply = handle_reply(data_fd, idle);
+        if (idle->notified) {
+            NM_LOG("KFMon's list of watches changed");
+            kfmon_session.notified = true;
+            idle->notified = false;
+        }
+        if (reply == KFMON_IPC_ENODATA || reply == KFMON_IPC_REPLY_READ_FAILURE) {
+            return false;
+        }
+        if (reply != KFMON_IPC_EAGAIN) {
+            // Replies are NUL-terminated, so only discard up to the end of this one (a notification could follow it).
+            char *end = memchr(idle->buf, '\0', idle->len);
+            size_t n  = end ? (size_t) (end - idle->buf) + 1U : idle->len;
+            NM_LOG("Discarding %zu stale bytes from KFMon", n);
+            memmove(idle->buf, idle->buf + n, idle->len - n);
+            idle->len -= n;
+        }
+    }
+}
+
+// Whether a request status means the session is still in a known state (i.e., KFMon replied to us properly).
+static bool kfmon_session_reusable(int status) {
+    switch (status) {
+        case KFMON_IPC_OK:
+        case KFMON_IPC_CALLOC_FAILURE:
+        case KFMON_IPC_ERR_INVALID_ID:
+        case KFMON_IPC_ERR_INVALID_NAME:
+        case KFMON_IPC_WARN_ALREADY_RUNNING:
+        case KFMON_IPC_WARN_SPAWN_BLOCKED:
+        case KFMON_IPC_WARN_SPAWN_INHIBITED:
+        case KFMON_IPC_ERR_REALLY_MALFORMED_CMD:
+        case KFMON_IPC_ERR_MALFORMED_CMD:
+        case KFMON_IPC_ERR_INVALID_CMD:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Push the deadline of a request back to KFMON_IPC_TIMEOUT_MS from now
+static void kfmon_request_touch(kfmon_request_t *req) {
+    clock_gettime(CLOCK_MONOTONIC, &req->deadline);
+    req->deadline.tv_sec  += KFMON_IPC_TIMEOUT_MS / 1000;
+    req->deadline.tv_nsec += (KFMON_IPC_TIMEOUT_MS % 1000) * 1000000L;
+    if (req->deadline.tv_nsec >= 1000000000L) {
+        req->deadline.tv_sec++;
+        req->deadline.tv_nsec -= 1000000000L;
+    }
+}
+
+// Get the number of milliseconds until the deadline of a request (0 if it has already passed)
+static int kfmon_request_remaining(const kfmon_request_t *req) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long ms = (req->deadline.tv_sec - now.tv_sec) * 1000L + (req->deadline.tv_nsec - now.tv_nsec) / 1000000L;
+    return ms < 0 ? 0 : (int) ms;
+}
+
+// Initialize a request for the specified IPC command:arg pair (or command alone if arg is NULL)
+static void kfmon_request_init(kfmon_request_t *req, const char *restrict ipc_cmd, const char *restrict ipc_arg, kfmon_watch_list_t *list, int *status_out) {
+    memset(req, 0, sizeof(*req));
+    int packet_len = 0;
+    // Somme commands don't require an arg
+    if (ipc_arg) {
+        packet_len = snprintf(req->packet, sizeof(req->packet), "%s:%s", ipc_cmd, ipc_arg);
+    } else {
+        packet_len = snprintf(req->packet, sizeof(req->packet), "%s", ipc_cmd);
+    }
+    // Send it w/ a NUL (and don't overrun the buffer if it was truncated)
+    req->packet_len = packet_len < 0 ? 1U : ((size_t) packet_len < sizeof(req->packet) ? (size_t) packet_len + 1U : sizeof(req->packet));
+    req->list       = list;
+    req->parser     = (kfmon_list_parser_t) { .list = list };
+    req->status_out = status_out;
+}
+
+// Add a request to the end of the queue. The lock must be held.
+static void kfmon_session_push(kfmon_request_t *req) {
+    req->next = NULL;
+    if (kfmon_session.tail) {
+        kfmon_session.tail->next = req;
+    } else {
+        kfmon_session.head = req;
+    }
+    kfmon_session.tail = req;
+}
+
+// Queue a subscribe request in front of the others. The lock must be held, and the head must not have been sent yet.
+static void kfmon_session_subscribe(void) {
+    kfmon_request_t *req = malloc(sizeof(*req));
+    if (!req) {
+        return;
+    }
+    kfmon_request_init(req, "subscribe", NULL, NULL, NULL);
+    req->cb        = kfmon_async_noop;
+    req->subscribe = true;
+    req->next      = kfmon_session.head;
+    kfmon_session.head = req;
+    if (!kfmon_session.tail) {
+        kfmon_session.tail = req;
+    }
+    kfmon_session.sub = KFMON_SUB_PENDING;
+}
+
+// Send the request at the head of the queue (connecting if needed). The lock must be held.
+static int kfmon_session_send(kfmon_request_t *req) {
+    // Did KFMon hang up since the last request?
+    if (kfmon_session.fd != -1 && !kfmon_session_alive(kfmon_session.fd)) {
+        NM_LOG("KFMon closed the IPC session, reconnecting");
+        kfmon_session_close();
+    }
+
+    req->fresh = false;
+    if (kfmon_session.fd == -1) {
+        // As long as KFMon is up, has very little chance to fail, even if the connection backlog is full.
+        int status = connect_to_kfmon_socket(&kfmon_session.fd);
+        if (status != EXIT_SUCCESS) {
+            kfmon_session_close();
+            return status;
+        }
+        req->fresh = true;
+        // This is a new connection, so try subscribing again if we couldn't before (KFMon may have been upgraded)
+        if (kfmon_session.sub == KFMON_SUB_INACTIVE) {
+            kfmon_session.sub = KFMON_SUB_NONE;
+        }
+    }
+
+    // Attempt to send the specified command in full over the wire
+    req->sent = true;
+    kfmon_request_touch(req);
+    return send_packet(kfmon_session.fd, req->packet, req->packet_len);
+}
+
+// Check for (more of) the reply to the request at the head of the queue without blocking. The lock must be held.
+static int kfmon_session_recv(kfmon_request_t *req) {
+    struct pollfd pfd = { 0 };
+    pfd.fd            = kfmon_session.fd;
+    pfd.events        = POLLIN;
+
+    int poll_num;
+    while ((poll_num = poll(&pfd, 1, 0)) == -1) {
+        if (errno != EINTR) {
             return KFMON_IPC_POLL_FAILURE;
         }
+    }
 
-        if (poll_num > 0) {
-            if (pfd.revents & POLLIN) {
-                // There was a reply from the socket
-                int reply = reply_handler(data_fd, data);
-                if (reply != EXIT_SUCCESS) {
-                    // If the remote closed the connection, we get POLLIN|POLLHUP w/ EoF ;).
-                    if (pfd.revents & POLLHUP) {
-                        // Flag that as an error
-                        status = KFMON_IPC_EPIPE;
-                    } else {
-                        if (reply == KFMON_IPC_EAGAIN) {
-                            // We're expecting more stuff to read, keep going.
-                            continue;
-                        } else {
-                            // Something went wrong when handling the reply, pass the error as-is
-                            status = reply;
-                        }
-                    }
-                    // We're obviously done if something went wrong.
-                    break;
-                } else {
-                    // We break on success, too, as we only need to send a single command.
-                    status = EXIT_SUCCESS;
-                    break;
-                }
+    if (poll_num > 0) {
+        if (pfd.revents & POLLIN) {
+            // There was a reply from the socket
+            int reply = req->list ? handle_list_reply(kfmon_session.fd, &req->parser) : handle_reply(kfmon_session.fd, &req->reply);
+            if (req->parser.notified || req->reply.notified) {
+                NM_LOG("KFMon's list of watches changed");
+                kfmon_session.notified = true;
+                req->parser.notified = false;
+                req->reply.notified  = false;
             }
-
-            // Remote closed the connection
-            if (pfd.revents & POLLHUP) {
-                // Flag that as an error
-                status = KFMON_IPC_EPIPE;
-                break;
+            if (reply == KFMON_IPC_EAGAIN) {
+                // We're expecting more stuff to read, keep going (and give KFMon more time, since it's still talking)
+                kfmon_request_touch(req);
+            } else if (reply != EXIT_SUCCESS && (pfd.revents & POLLHUP)) {
+                // If the remote closed the connection, we get POLLIN|POLLHUP w/ EoF ;).
+                return KFMON_IPC_EPIPE;
             }
+            return reply;
         }
 
-        if (poll_num == 0) {
-            // Timed out, increase the retry counter
-            retry++;
+        // Remote closed the connection
+        if (pfd.revents & (POLLHUP | POLLERR | POLLNVAL)) {
+            return KFMON_IPC_EPIPE;
         }
+    }
+
+    // Drop the axe if KFMon has been silent for too long
+    if (!kfmon_request_remaining(req)) {
+        return KFMON_IPC_ETIMEDOUT;
+    }
+    return KFMON_IPC_EAGAIN;
+}
 
-        // Drop the axe after the final attempt
-        if (retry >= attempts) {
-            status = KFMON_IPC_ETIMEDOUT;
+// Make as much progress as possible on the queue without blocking. Completed asynchronous requests are removed from
+// the queue and returned (linked by next) so their callbacks can be called without the lock. The lock must be held.
+static kfmon_request_t *kfmon_session_step(void) {
+    kfmon_request_t *completed = NULL, **completed_tail = &completed;
+
+    // Check for notifications (and whether KFMon is still there) while we aren't waiting on anything
+    if (!kfmon_session.head && kfmon_session.fd != -1 && !kfmon_session_alive(kfmon_session.fd)) {
+        NM_LOG("KFMon closed the IPC session");
+        kfmon_session_close();
+    }
+
+    while (1) {
+        // Subscribe before the next request if needed
+        if (kfmon_session.sub_cb && kfmon_session.sub == KFMON_SUB_NONE && !(kfmon_session.head && kfmon_session.head->sent)) {
+            kfmon_session_subscribe();
+        }
+        if (!kfmon_session.head) {
             break;
         }
+        kfmon_request_t *req = kfmon_session.head;
+
+        int status = req->sent ? EXIT_SUCCESS : kfmon_session_send(req);
+        if (status == EXIT_SUCCESS) {
+            status = kfmon_session_recv(req);
+        }
+        if (status == KFMON_IPC_EAGAIN) {
+            // Still waiting on KFMon
+            break;
+        }
+
+        if (!kfmon_session_reusable(status)) {
+            kfmon_session_close();
+
+            // If KFMon hung up between our check and the request (and we didn't get anything from it), a single
+            // transparent retry on a new connection is safe, as it never saw the command.
+            if (!req->fresh && !req->attempt && (status == KFMON_IPC_EPIPE || status == KFMON_IPC_ENODATA) && !(req->list && req->list->count)) {
+                NM_LOG("KFMon IPC session was lost, retrying request once");
+                req->attempt++;
+                req->sent = false;
+                req->parser.len = 0;
+                req->parser.replied = false;
+                req->reply.len = 0;
+                continue;
+            }
+        }
+
+        // We're done with this one
+        if (req->subscribe) {
+            if (status == KFMON_IPC_OK) {
+                NM_LOG("Subscribed to KFMon's list change notifications");
+                kfmon_session.sub = KFMON_SUB_ACTIVE;
+            } else {
+                NM_LOG("Couldn't subscribe to KFMon's list change notifications (status %d)", status);
+                kfmon_session.sub = KFMON_SUB_INACTIVE;
+            }
+        }
+        kfmon_session.head = req->next;
+        if (!kfmon_session.head) {
+            kfmon_session.tail = NULL;
+        }
+        free(req->parser.buf);
+        req->parser.buf = NULL;
+        if (req->status_out) {
+            *req->status_out = status;
+        }
+        if (req->cb) {
+            *completed_tail = req;
+            completed_tail  = &req->next;
+            req->next       = NULL;
+        } else {
+            // NOTE: The waiter owns the request, so it must not be touched after this.
+            req->done = true;
+        }
     }
 
-    return status;
+    return completed;
 }
 
-// Handle a simple KFMon IPC request
-int nm_kfmon_simple_request(const char *restrict ipc_cmd, const char *restrict ipc_arg) {
-    // Assume everything's peachy until shit happens...
-    int status = EXIT_SUCCESS;
+// Take the pending notification (if any), and return the callback to call for it. The lock must be held.
+static kfmon_async_cb_t kfmon_session_notification(void **ctx_out) {
+    if (!kfmon_session.notified || !kfmon_session.sub_cb) {
+        return NULL;
+    }
+    kfmon_session.notified = false;
+    *ctx_out = kfmon_session.sub_ctx;
+    return kfmon_session.sub_cb;
+}
 
-    int data_fd = -1;
-    // Attempt to connect to KFMon...
-    // As long as KFMon is up, has very little chance to fail, even if the connection backlog is full.
-    status = connect_to_kfmon_socket(&data_fd);
-    // If it failed, return early
-    if (status != EXIT_SUCCESS) {
-        return status;
+// Call the callbacks of completed asynchronous requests (and the notification one, if not NULL), and free them. The
+// lock must not be held.
+static void kfmon_session_complete(kfmon_request_t *completed, kfmon_async_cb_t notify_cb, void *notify_ctx) {
+    while (completed) {
+        kfmon_request_t *req = completed;
+        completed = req->next;
+        if (req->cb != kfmon_async_noop) {
+            req->cb(req->ctx);
+        }
+        free(req);
+    }
+    if (notify_cb) {
+        notify_cb(notify_ctx);
     }
+}
 
-    // Attempt to send the specified command in full over the wire
-    status = send_ipc_command(data_fd, ipc_cmd, ipc_arg);
-    // If it failed, return early, after closing the socket
-    if (status != EXIT_SUCCESS) {
-        close(data_fd);
-        return status;
-    }
-
-    // We'll be polling the socket for a reply, this'll make things neater, and allows us to abort on timeout,
-    // in the unlikely event there's already an IPC session being handled by KFMon,
-    // in which case the reply would be delayed by an undeterminate amount of time (i.e., until KFMon gets to it).
-    // Here, we'll want to timeout after 2s
-    ipc_handler_t handler = &handle_reply;
-    status = wait_for_replies(data_fd, 500, 4, handler, NULL);
-    // NOTE: We happen to be done with the connection right now.
-    //       But if we still needed it, KFMON_IPC_POLL_FAILURE would warrant an early abort w/ a forced close().
-
-    // Bye now!
-    close(data_fd);
+// Queue requests and wait for them to complete, making progress on anything queued before them in the meantime.
+static void kfmon_session_wait(kfmon_request_t *reqs, size_t n) {
+    pthread_mutex_lock(&kfmon_session.lock);
+    for (size_t i = 0; i < n; i++) {
+        kfmon_session_push(&reqs[i]);
+    }
+    while (1) {
+        kfmon_request_t *completed = kfmon_session_step();
+        void *notify_ctx = NULL;
+        kfmon_async_cb_t notify_cb = kfmon_session_notification(&notify_ctx);
+        // The requests complete in order, so we're done once the last one is
+        bool done   = reqs[n - 1].done;
+        int data_fd = kfmon_session.fd;
+        int timeout = kfmon_session.head ? kfmon_request_remaining(kfmon_session.head) : 0;
+        pthread_mutex_unlock(&kfmon_session.lock);
+
+        kfmon_session_complete(completed, notify_cb, notify_ctx);
+        if (done) {
+            return;
+        }
+
+        // Wait for KFMon (we'll be woken up early if someone else handles the reply).
+        struct pollfd pfd = { 0 };
+        pfd.fd            = data_fd;
+        pfd.events        = POLLIN;
+        poll(&pfd, data_fd == -1 ? 0U : 1U, timeout < 50 ? timeout : 50);
+
+        pthread_mutex_lock(&kfmon_session.lock);
+    }
+}
+
+// Queue an asynchronous request. It'll be handled by nm_kfmon_async_step (or anyone else waiting on the session).
+static void kfmon_session_post(const char *restrict ipc_cmd, const char *restrict ipc_arg, kfmon_watch_list_t *list, int *status_out, kfmon_async_cb_t cb, void *ctx) {
+    kfmon_request_t *req = malloc(sizeof(*req));
+    kfmon_request_init(req, ipc_cmd, ipc_arg, list, status_out);
+    req->cb  = cb ? cb : kfmon_async_noop;
+    req->ctx = ctx;
+
+    pthread_mutex_lock(&kfmon_session.lock);
+    kfmon_session_push(req);
+    pthread_mutex_unlock(&kfmon_session.lock);
+}
+
+// Handle a simple KFMon IPC request
+int nm_kfmon_simple_request(const char *restrict ipc_cmd, const char *restrict ipc_arg) {
+    int status = EXIT_SUCCESS;
+    kfmon_request_t req;
+    kfmon_request_init(&req, ipc_cmd, ipc_arg, NULL, &status);
+    kfmon_session_wait(&req, 1);
     return status;
 }
 
 // Handle a list request for the KFMon generator
 int nm_kfmon_list_request(const char *restrict ipc_cmd, kfmon_watch_list_t *list) {
-    // Assume everything's peachy until shit happens...
     int status = EXIT_SUCCESS;
+    kfmon_request_t req;
+    kfmon_request_init(&req, ipc_cmd, NULL, list, &status);
+    kfmon_session_wait(&req, 1);
+    return status;
+}
 
-    int data_fd = -1;
-    // Attempt to connect to KFMon...
-    // As long as KFMon is up, has very little chance to fail, even if the connection backlog is full.
-    status = connect_to_kfmon_socket(&data_fd);
-    // If it failed, return early
-    if (status != EXIT_SUCCESS) {
-        return status;
+// Handle a batch of simple KFMon IPC requests
+void nm_kfmon_batch_request(kfmon_batch_request_t *reqs, size_t n) {
+    // NOTE: KFMon handles a single command per read, so we can't just send all the packets back-to-back, as they could
+    //       end up being coalesced by the socket and silently dropped. Instead, they're queued together, which means
+    //       nothing else can get in between (e.g., a generator refresh).
+    kfmon_request_t batch[NM_KFMON_BATCH_MAX];
+    for (size_t i = 0; i < n && i < NM_KFMON_BATCH_MAX; i++) {
+        kfmon_request_init(&batch[i], reqs[i].cmd, reqs[i].arg, NULL, &reqs[i].status);
     }
+    if (n) {
+        kfmon_session_wait(batch, n < NM_KFMON_BATCH_MAX ? n : NM_KFMON_BATCH_MAX);
+    }
+}
 
-    // Attempt to send the specified command in full over the wire
-    status = send_ipc_command(data_fd, ipc_cmd, NULL);
-    // If it failed, return early, after closing the socket
-    if (status != EXIT_SUCCESS) {
-        close(data_fd);
-        return status;
-    }
-
-    // We'll be polling the socket for a reply, this'll make things neater, and allows us to abort on timeout,
-    // in the unlikely event there's already an IPC session being handled by KFMon,
-    // in which case the reply would be delayed by an undeterminate amount of time (i.e., until KFMon gets to it).
-    // Here, we'll want to timeout after 2s
-    ipc_handler_t handler = &handle_list_reply;
-    status = wait_for_replies(data_fd, 500, 4, handler, (void *) list);
-    // NOTE: We happen to be done with the connection right now.
-    //       But if we still needed it, KFMON_IPC_POLL_FAILURE would warrant an early abort w/ a forced close().
-
-    // Bye now!
-    close(data_fd);
-    return status;
+void nm_kfmon_async_batch_request(kfmon_batch_request_t *reqs, size_t n, kfmon_async_cb_t cb, void *ctx) {
+    pthread_mutex_lock(&kfmon_session.lock);
+    for (size_t i = 0; i < n; i++) {
+        kfmon_request_t *req = malloc(sizeof(*req));
+        kfmon_request_init(req, reqs[i].cmd, reqs[i].arg, NULL, &reqs[i].status);
+        req->cb  = i == n - 1 ? cb : kfmon_async_noop;
+        req->ctx = ctx;
+        kfmon_session_push(req);
+    }
+    pthread_mutex_unlock(&kfmon_session.lock);
+}
+
+void nm_kfmon_async_list_request(const char *restrict ipc_cmd, kfmon_watch_list_t *list, int *status_out, kfmon_async_cb_t cb, void *ctx) {
+    kfmon_session_post(ipc_cmd, NULL, list, status_out, cb, ctx);
+}
+
+int nm_kfmon_async_step(int *timeout_ms_out) {
+    pthread_mutex_lock(&kfmon_session.lock);
+    kfmon_request_t *completed = kfmon_session_step();
+    void *notify_ctx = NULL;
+    kfmon_async_cb_t notify_cb = kfmon_session_notification(&notify_ctx);
+    // If we're subscribed, keep waiting for notifications even if there's nothing else to do
+    int data_fd = kfmon_session.head || (kfmon_session.sub_cb && kfmon_session.sub == KFMON_SUB_ACTIVE) ? kfmon_session.fd : -1;
+    *timeout_ms_out = kfmon_session.head ? kfmon_request_remaining(kfmon_session.head) : -1;
+    pthread_mutex_unlock(&kfmon_session.lock);
+
+    kfmon_session_complete(completed, notify_cb, notify_ctx);
+    return data_fd;
+}
+
+void nm_kfmon_async_subscribe(kfmon_async_cb_t cb, void *ctx) {
+    pthread_mutex_lock(&kfmon_session.lock);
+    kfmon_session.sub_cb   = cb;
+    kfmon_session.sub_ctx  = ctx;
+    kfmon_session.notified = false;
+    pthread_mutex_unlock(&kfmon_session.lock);
+}
+
+bool nm_kfmon_subscribed(void) {
+    pthread_mutex_lock(&kfmon_session.lock);
+    bool subscribed = kfmon_session.sub_cb && kfmon_session.sub == KFMON_SUB_ACTIVE;
+    pthread_mutex_unlock(&kfmon_session.lock);
+    return subscribed;
+}
+
+// Get the IPC command used by a kfmon or kfmon_id action, or NULL if it's something else
+static const char *kfmon_batch_cmd(nm_action_fn_t act) {
+    if (act == NM_ACTION(kfmon)) {
+        return "trigger";
+    } else if (act == NM_ACTION(kfmon_id)) {
+        return "start";
+    }
+    return NULL;
+}
+
+size_t nm_kfmon_batch_collect(nm_menu_action_t *act, kfmon_batch_request_t *reqs_out) {
+    size_t n = 0;
+    for (nm_menu_action_t *cur = act; cur && n < NM_KFMON_BATCH_MAX; cur = cur->next) {
+        const char *cmd = kfmon_batch_cmd(cur->act);
+        // Only the first one can be conditional, as the rest need to run whatever the result of the previous one is.
+        if (!cmd || (n && !(cur->on_success && cur->on_failure))) {
+            break;
+        }
+        reqs_out[n].cmd    = cmd;
+        reqs_out[n].arg    = cur->arg;
+        reqs_out[n].status = EXIT_SUCCESS;
+        n++;
+    }
+    return n;
+}
+
+size_t nm_kfmon_batch_start(kfmon_batch_t *batch, nm_menu_action_t *act) {
+    if (batch->i < batch->n) {
+        return 0;
+    }
+    // Collect into a separate count so a non-kfmon action doesn't reset the state of the previous batch
+    size_t n = nm_kfmon_batch_collect(act, batch->reqs);
+    if (n) {
+        batch->n = n;
+        batch->i = 0;
+    }
+    return n;
+}
+
+bool nm_kfmon_batch_next(kfmon_batch_t *batch, int *status_out) {
+    if (batch->i >= batch->n) {
+        return false;
+    }
+    *status_out = batch->reqs[batch->i++].status;
+    return true;
+}
+
+nm_action_result_t *nm_kfmon_batch_result(nm_action_fn_t act, int status) {
+    // Same fixup as the kfmon action itself
+    if (act == NM_ACTION(kfmon) && status == KFMON_IPC_ERR_INVALID_ID) {
+        status = KFMON_IPC_ERR_INVALID_NAME;
+    }
+    return nm_kfmon_return_handler(status);
 }
 
 // Giant ladder of fail
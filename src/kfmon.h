@@ -9,9 +9,17 @@ extern "C" {
 #include <stdint.h>
 #include <stdlib.h>
 #include "action.h"
+#include "nickelmenu.h"
 
 // Path to KFMon's IPC Unix socket
+#ifndef KFMON_IPC_SOCKET
 #define KFMON_IPC_SOCKET "/tmp/kfmon-ipc.ctl"
+#endif
+
+// How long to wait for KFMon to start (or continue) replying
+#ifndef KFMON_IPC_TIMEOUT_MS
+#define KFMON_IPC_TIMEOUT_MS 2000
+#endif
 
 // Flags for the failure bingo
 typedef enum {
@@ -42,37 +50,47 @@ typedef enum {
     KFMON_IPC_UNKNOWN_REPLY,
     // Not an error either, means we have more to read...
     KFMON_IPC_EAGAIN,
+    // Not an error either, KFMon told us its list of watches changed (only if we subscribed to that)
+    KFMON_IPC_NOTIFY_LIST_CHANGED,
 } kfmon_ipc_errno_e;
 
 // A single watch item
 typedef struct {
     uint8_t idx;
-    char *filename;
-    char *label;
+    uint32_t filename; // offset of the filename in the list's strings
+    uint32_t label;    // offset of the label in the list's strings (same as filename if it doesn't have one)
 } kfmon_watch_t;
 
-// A node in a linked list of watches
-typedef struct kfmon_watch_node {
-    kfmon_watch_t watch;
-    struct kfmon_watch_node *next;
-} kfmon_watch_node_t;
-
-// A control structure to keep track of a list of watches
+// A control structure to keep track of a list of watches. The watches are
+// stored contiguously, and their strings are stored in a single buffer.
 typedef struct {
     size_t count;
-    kfmon_watch_node_t *head;
-    kfmon_watch_node_t *tail;
+    kfmon_watch_t *watches;
+    size_t cap;
+    char *strings;
+    size_t strings_len;
+    size_t strings_cap;
 } kfmon_watch_list_t;
 
+// Get the filename of a watch in a list
+static inline const char *kfmon_watch_filename(const kfmon_watch_list_t *list, const kfmon_watch_t *watch) {
+    return list->strings + watch->filename;
+}
+
+// Get the label of a watch in a list
+static inline const char *kfmon_watch_label(const kfmon_watch_list_t *list, const kfmon_watch_t *watch) {
+    return list->strings + watch->label;
+}
+
 // Used as the reply handler in our polling loops.
-// Second argument is an opaque pointer used for storage in a linked list
+// Second argument is an opaque pointer used for storage
 // (e.g., a pointer to a kfmon_watch_list_t, or NULL if no storage is needed).
 typedef int (*ipc_handler_t)(int, void *);
 
-// Free all resources allocated by a list and its nodes
+// Free all resources allocated by a list
 void kfmon_teardown_list(kfmon_watch_list_t *list);
-// Allocate a single new node to the list
-int kfmon_grow_list(kfmon_watch_list_t *list);
+// Append a single watch to the list
+int kfmon_grow_list(kfmon_watch_list_t *list, uint8_t idx, const char *filename, const char *label);
 
 // If status is success, false is returned. Otherwise, true is returned and
 // nm_err is set.
@@ -82,10 +100,82 @@ bool nm_kfmon_error_handler(kfmon_ipc_errno_e status);
 nm_action_result_t *nm_kfmon_return_handler(kfmon_ipc_errno_e status);
 
 // Send a simple KFMon IPC request, one where the reply is only used for its diagnostic value.
-int nm_kfmon_simple_request(const char *restrict ipc_cmd, const char *restrict ipc_arg);
+int nm_kfmon_simple_request(const char *ipc_cmd, const char *ipc_arg);
 
 // Handle a list request for the KFMon generator
-int nm_kfmon_list_request(const char *restrict ipc_cmd, kfmon_watch_list_t *list);
+int nm_kfmon_list_request(const char *ipc_cmd, kfmon_watch_list_t *list);
+
+// Maximum number of requests in a batch
+#define NM_KFMON_BATCH_MAX 8
+
+// A single simple request in a batch
+typedef struct {
+    const char *cmd;
+    const char *arg;
+    int status; // set to the result of the request
+} kfmon_batch_request_t;
+
+// Send several simple KFMon IPC requests in order, without letting other requests in between.
+void nm_kfmon_batch_request(kfmon_batch_request_t *reqs, size_t n);
+
+// If act is a kfmon or kfmon_id action, fill reqs_out (which must have room for NM_KFMON_BATCH_MAX requests) with it
+// and any following kfmon or kfmon_id actions which always run (i.e., chain_always), so they can be sent as a single
+// batch. Returns the number of requests, or 0 if act isn't a kfmon action.
+size_t nm_kfmon_batch_collect(nm_menu_action_t *act, kfmon_batch_request_t *reqs_out);
+
+// The kfmon requests for a chain of actions, which are sent in batches.
+typedef struct {
+    kfmon_batch_request_t reqs[NM_KFMON_BATCH_MAX]; // the pending or completed requests of the current batch
+    size_t n;
+    size_t i; // the next completed request to use
+} kfmon_batch_t;
+
+// If the current batch has been used up and act is a kfmon or kfmon_id action, start a new batch at act (see
+// nm_kfmon_batch_collect). Returns the number of requests to send and wait for before running act, or 0 (leaving the
+// batch as-is) if there is nothing to send.
+size_t nm_kfmon_batch_start(kfmon_batch_t *batch, nm_menu_action_t *act);
+
+// If a completed request from the current batch is left for the next action, store its status in status_out and
+// return true.
+bool nm_kfmon_batch_next(kfmon_batch_t *batch, int *status_out);
+
+// Get the result which the kfmon or kfmon_id action would have returned for the specified status.
+nm_action_result_t *nm_kfmon_batch_result(nm_action_fn_t act, int status);
+
+// Called once an asynchronous request completes.
+typedef void (*kfmon_async_cb_t)(void *ctx);
+
+// Queue n (at least one) simple requests without waiting for them. The status of each one is set as it completes, and
+// cb is called once all of them have. reqs must remain valid until then. Note that cb may be called from any thread
+// which is waiting on a KFMon request, so the event loop should use nm_kfmon_post_batch_request instead.
+void nm_kfmon_async_batch_request(kfmon_batch_request_t *reqs, size_t n, kfmon_async_cb_t cb, void *ctx);
+
+// Like nm_kfmon_async_batch_request, but for a list request. list and status_out must remain valid until cb is called.
+void nm_kfmon_async_list_request(const char *ipc_cmd, kfmon_watch_list_t *list, int *status_out, kfmon_async_cb_t cb, void *ctx);
+
+// Make as much progress as possible on queued requests without blocking, and call the callbacks of the completed ones.
+// Returns the fd to wait on for POLLIN before calling it again, or -1 if nothing is pending. The maximum time to wait
+// is stored in timeout_ms_out (or -1 if nothing is pending).
+int nm_kfmon_async_step(int *timeout_ms_out);
+
+// Subscribe to notifications from KFMon when its list of watches changes (or unsubscribe if cb is NULL). cb is called
+// (like the callbacks of asynchronous requests) for each one. This requires a KFMon build which supports the subscribe
+// command, and while it's in progress or if it's not supported, nm_kfmon_subscribed returns false. The subscription is
+// renewed as needed if the session is lost, but only once something (e.g., a request) reconnects.
+void nm_kfmon_async_subscribe(kfmon_async_cb_t cb, void *ctx);
+
+// Whether we're currently subscribed to notifications.
+bool nm_kfmon_subscribed(void);
+
+// Like nm_kfmon_async_batch_request, but cb is always called from the event loop (and never from within the call), and
+// progress is made using a QSocketNotifier. Must be called from the GUI thread.
+void nm_kfmon_post_batch_request(kfmon_batch_request_t *reqs, size_t n, kfmon_async_cb_t cb, void *ctx);
+
+// Like nm_kfmon_async_list_request, but see nm_kfmon_post_batch_request.
+void nm_kfmon_post_list_request(const char *ipc_cmd, kfmon_watch_list_t *list, int *status_out, kfmon_async_cb_t cb, void *ctx);
+
+// Like nm_kfmon_async_subscribe, but see nm_kfmon_post_batch_request.
+void nm_kfmon_post_subscribe(kfmon_async_cb_t cb, void *ctx);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,99 @@
+#include <QSocketNotifier>
+#include <QTimer>
+
+#include <stddef.h>
+#include <stdlib.h>
+
+#include "kfmon.h"
+#include "util.h"
+
+// note: only used from the GUI thread
+static QSocketNotifier *nm_kfmon_notifier    = nullptr;
+static int              nm_kfmon_notifier_fd = -1;
+static QTimer          *nm_kfmon_timer       = nullptr;
+
+// nm_kfmon_pump makes progress on the queued KFMon requests, then waits for
+// the socket to become readable (or the current request to time out) without
+// blocking the event loop.
+static void nm_kfmon_pump() {
+    int timeout;
+    int fd = nm_kfmon_async_step(&timeout);
+
+    if (fd != nm_kfmon_notifier_fd) {
+        if (nm_kfmon_notifier) {
+            // we might be in its activated signal
+            nm_kfmon_notifier->setEnabled(false);
+            nm_kfmon_notifier->deleteLater();
+            nm_kfmon_notifier = nullptr;
+        }
+        if ((nm_kfmon_notifier_fd = fd) != -1) {
+            nm_kfmon_notifier = new QSocketNotifier(fd, QSocketNotifier::Read);
+            QObject::connect(nm_kfmon_notifier, &QSocketNotifier::activated, [](int) {
+                nm_kfmon_pump();
+            });
+        }
+    }
+
+    if (!nm_kfmon_timer) {
+        nm_kfmon_timer = new QTimer();
+        nm_kfmon_timer->setSingleShot(true);
+        QObject::connect(nm_kfmon_timer, &QTimer::timeout, []() {
+            nm_kfmon_pump();
+        });
+    }
+    if (timeout >= 0)
+        nm_kfmon_timer->start(timeout + 1);
+    else
+        nm_kfmon_timer->stop();
+}
+
+typedef struct {
+    kfmon_async_cb_t cb;
+    void *ctx;
+} nm_kfmon_post_t;
+
+// nm_kfmon_post_cb is the callback for posted requests. Since it may be called
+// while a synchronous request is waiting (e.g. from within a generator), the
+// actual callback is always deferred to the event loop.
+static void nm_kfmon_post_cb(void *ctx) {
+    nm_kfmon_post_t *p = reinterpret_cast<nm_kfmon_post_t*>(ctx);
+    QTimer *t = new QTimer(); // note: QTimer::singleShot with a functor requires Qt 5.4
+    t->setSingleShot(true);
+    QObject::connect(t, &QTimer::timeout, [p, t]() {
+        p->cb(p->ctx);
+        delete p;
+        t->deleteLater();
+    });
+    t->start(0);
+}
+
+extern "C" void nm_kfmon_post_batch_request(kfmon_batch_request_t *reqs, size_t n, kfmon_async_cb_t cb, void *ctx) {
+    nm_kfmon_async_batch_request(reqs, n, nm_kfmon_post_cb, new nm_kfmon_post_t{cb, ctx});
+    nm_kfmon_pump();
+}
+
+extern "C" void nm_kfmon_post_list_request(const char *ipc_cmd, kfmon_watch_list_t *list, int *status_out, kfmon_async_cb_t cb, void *ctx) {
+    nm_kfmon_async_list_request(ipc_cmd, list, status_out, nm_kfmon_post_cb, new nm_kfmon_post_t{cb, ctx});
+    nm_kfmon_pump();
+}
+
+static nm_kfmon_post_t nm_kfmon_post_sub = {nullptr, nullptr};
+
+// nm_kfmon_post_sub_cb is the callback for the subscription. Like
+// nm_kfmon_post_cb, the actual callback is deferred to the event loop.
+static void nm_kfmon_post_sub_cb(void *) {
+    QTimer *t = new QTimer();
+    t->setSingleShot(true);
+    QObject::connect(t, &QTimer::timeout, [t]() {
+        if (nm_kfmon_post_sub.cb)
+            nm_kfmon_post_sub.cb(nm_kfmon_post_sub.ctx);
+        t->deleteLater();
+    });
+    t->start(0);
+}
+
+extern "C" void nm_kfmon_post_subscribe(kfmon_async_cb_t cb, void *ctx) {
+    nm_kfmon_post_sub = {cb, ctx};
+    nm_kfmon_async_subscribe(cb ? nm_kfmon_post_sub_cb : nullptr, nullptr);
+    nm_kfmon_pump();
+}
@@ -1,23 +1,44 @@
 #include <QAction>
+#include <QApplication>
+#include <QByteArray>
 #include <QCoreApplication>
+#include <QCryptographicHash>
+#include <QDir>
+#include <QEvent>
 #include <QFile>
+#include <QFileInfo>
+#include <QHash>
+#include <QImage>
+#include <QImageReader>
 #include <QLayout>
+#include <QList>
 #include <QMenu>
 #include <QMetaProperty>
+#include <QPointer>
 #include <QPushButton>
-#include <QRegularExpression>
+#include <QSocketNotifier>
 #include <QString>
-#include <QUrl>
+#include <QStringList>
+#include <QTimer>
+#include <QVariant>
 #include <QWidget>
 #include <QWidgetAction>
 
+#include <cstdio>
 #include <cstdlib>
+#include <initializer_list>
 
 #include <NickelHook.h>
 
 #include "action.h"
+#include "argtransform.h"
 #include "config.h"
+#include "generator.h"
+#include "kfmon.h"
 #include "nickelmenu.h"
+#include "stall.h"
+#include "stats.h"
+#include "trace.h"
 #include "util.h"
 
 typedef QWidget MenuTextItem; // it's actually a subclass, but we don't need its functionality directly, so we'll stay on the safe side
@@ -166,24 +187,49 @@ NickelHook(
     .dlsym = NickelMenuDlsym,
 )
 
-// AbstractNickelMenuController_createAction_before wraps
+// AbstractNickelMenuController_createAction_detached wraps
 // AbstractNickelMenuController::createAction to use the correct separator for
-// the menu location and to match the behaviour of QMenu::insertAction instead
-// of QMenu::addAction. It also adds the property nm_action=true to the action
-// and separator.
-QAction *AbstractNickelMenuController_createAction_before(QAction *before, nm_menu_location_t loc, bool last_in_group, void *_this, QMenu *menu, QWidget *widget, bool close, bool enabled, bool separator);
+// the menu location, but doesn't add the action or separator to the menu, so
+// they can be inserted together with others (with QMenu::insertActions). The
+// separator is returned in sep_out (or nullptr if separator is false). It also
+// adds the property nm_action=true to the action and separator.
+QAction *AbstractNickelMenuController_createAction_detached(nm_menu_location_t loc, bool last_in_group, void *_this, QMenu *menu, QWidget *widget, bool close, bool enabled, bool separator, QAction **sep_out);
 
 // nm_argtranform_t transforms an action's argument and returns a new malloc'd
 // string. On error, it should return NULL and set nm_err.
 typedef char *(*nm_argtransform_t)(void *data, const char *arg);
 
 // nm_menu_item_do runs a nm_menu_item_t and must be called from the thread of a
-// signal handler. argtransform and argtransform_data are optional.
+// signal handler. argtransform and argtransform_data are optional. If the chain
+// needs to wait for KFMon (without an argtransform), it returns early and is
+// continued from the event loop once KFMon replies.
 static void nm_menu_item_do(nm_menu_item_t *it, nm_argtransform_t argtransform, void *argtransform_data);
 
+// nm_menu_item_run_t is the state of a chain started by nm_menu_item_do.
+typedef struct nm_menu_item_run_t {
+    nm_menu_item_t        *it; // a copy, since the config may be updated (and the original freed) while waiting
+    nm_argtransform_t     argtransform;
+    void                  *argtransform_data;
+    nm_menu_action_t      *cur;
+    bool                  success;
+    int                   skip;
+    kfmon_batch_t         batch;
+} nm_menu_item_run_t;
+
+// nm_menu_item_run runs (or continues) a chain. It frees run when done.
+static void nm_menu_item_run(nm_menu_item_run_t *run);
+
+// nm_menu_item_resume continues a chain after KFMon replies.
+static void nm_menu_item_resume(void *ctx);
+
 // _nm_menu_inject handles the QMenu::aboutToShow signal and injects menu items.
 static void _nm_menu_inject(void *nmc, QMenu *menu, nm_menu_location_t loc, int at);
 
+// nm_menu_item_key returns an identity for a menu item which is stable across
+// config revisions. It doesn't include the label, so it can be updated in
+// place.
+static QByteArray nm_menu_item_key(nm_menu_item_t *it);
+
 static int nm_init() {
     #ifdef NM_UNINSTALL_CONFIGDIR
     NM_LOG("feature: NM_UNINSTALL_CONFIGDIR: true");
@@ -211,61 +257,148 @@ static int nm_init() {
     return 0;
 }
 
+// nm_menu_anchor_t is the label of an existing menu item which is used to find
+// the menu to inject items into. Since createMenuTextItem is called for every
+// menu item Nickel creates, the translations are cached.
+typedef struct {
+    const char         *context;
+    const char         *source;
+    nm_menu_location_t loc;
+    const char         *loc_name;
+    QString            tr;
+    uint               tr_hash;
+} nm_menu_anchor_t;
+
+static nm_menu_anchor_t nm_menu_anchors[] = {
+    {"StatusBarMenuController",         "Settings",         NM_MENU_LOCATION(main),    "main",    {}, 0},
+    {"DictionaryActionProxy",           "Dictionary",       NM_MENU_LOCATION(reader),  "reader",  {}, 0},
+    {"N3BrowserSettingsMenuController", "Keyboard",         NM_MENU_LOCATION(browser), "browser", {}, 0},
+    {"LibraryViewMenuController",       "Manage downloads", NM_MENU_LOCATION(library), "library", {}, 0}, // this is actually two menus: in "My Books", and in "My Articles"
+};
+
+static bool nm_menu_anchors_valid = false; // note: only used from the GUI thread
+
+// nm_menu_anchors_filter invalidates the anchor translations when the language
+// is changed.
+class nm_menu_anchors_filter : public QObject {
+public:
+    bool eventFilter(QObject *obj, QEvent *ev) override {
+        if (ev->type() == QEvent::LanguageChange && obj == QCoreApplication::instance())
+            nm_menu_anchors_valid = false;
+        return false;
+    }
+};
+
+static void nm_menu_anchors_update() {
+    static nm_menu_anchors_filter *filter = nullptr;
+    if (!filter) {
+        filter = new nm_menu_anchors_filter();
+        QCoreApplication::instance()->installEventFilter(filter);
+    }
+
+    for (nm_menu_anchor_t &a : nm_menu_anchors) {
+        a.tr      = QCoreApplication::translate(a.context, a.source);
+        a.tr_hash = qHash(a.tr);
+        NM_LOG("Menu anchor for %s: '%s'", a.source, qPrintable(a.tr));
+    }
+    nm_menu_anchors_valid = true;
+}
+
 extern "C" __attribute__((visibility("default"))) MenuTextItem* _nm_menu_hook(void* _this, QMenu* menu, QString const& label, bool checkable, bool checked, QString const& thingy) {
-    NM_LOG("AbstractNickelMenuController::createMenuTextItem(%p, `%s`, %d, %d, `%s`)", menu, qPrintable(label), checkable, checked, qPrintable(thingy));
-
-    QString trmm = QCoreApplication::translate("StatusBarMenuController", "Settings");
-    QString trrm = QCoreApplication::translate("DictionaryActionProxy", "Dictionary");
-    QString trbm = QCoreApplication::translate("N3BrowserSettingsMenuController", "Keyboard");
-    QString trlm = QCoreApplication::translate("LibraryViewMenuController", "Manage downloads");
-    NM_LOG("Comparing against '%s', '%s', '%s', '%s'", qPrintable(trmm), qPrintable(trrm), qPrintable(trbm), qPrintable(trlm));
-
-    nm_menu_location_t loc = {};
-    if (label == trmm && !checkable) {
-        NM_LOG("Intercepting main menu (label=Settings, checkable=false)...");
-        loc = NM_MENU_LOCATION(main);
-    } else if (label == trrm && !checkable) {
-        NM_LOG("Intercepting reader menu (label=Dictionary, checkable=false)...");
-        loc = NM_MENU_LOCATION(reader);
-    } else if (label == trbm && !checkable) {
-        NM_LOG("Intercepting browser menu (label=Keyboard, checkable=false)...");
-        loc = NM_MENU_LOCATION(browser);
-    } else if (label == trlm && !checkable) {
-        NM_LOG("Intercepting library menu (label=Manage downloads, checkable=false)...");  // this is actually two menus: in "My Books", and in "My Articles"
-        loc = NM_MENU_LOCATION(library);
-    }
-
-    if (loc)
-        QObject::connect(menu, &QMenu::aboutToShow, std::bind(_nm_menu_inject, _this, menu, loc, menu->actions().count()));
+    NM_LOG_VERBOSE("AbstractNickelMenuController::createMenuTextItem(%p, `%s`, %d, %d, `%s`)", menu, qPrintable(label), checkable, checked, qPrintable(thingy));
+
+    // None of the anchors are checkable
+    if (!checkable) {
+        if (!nm_menu_anchors_valid)
+            nm_menu_anchors_update();
+
+        bool hashed = false;
+        uint hash = 0;
+        for (const nm_menu_anchor_t &a : nm_menu_anchors) {
+            if (label.size() != a.tr.size())
+                continue;
+            if (!hashed) {
+                hash = qHash(label);
+                hashed = true;
+            }
+            if (hash != a.tr_hash || label != a.tr)
+                continue;
+
+            NM_TRACE_SCOPE(hook_menu, a.loc_name);
+            NM_LOG("Intercepting %s menu (label=%s, checkable=false)...", a.loc_name, a.source);
+            QObject::connect(menu, &QMenu::aboutToShow, std::bind(_nm_menu_inject, _this, menu, a.loc, menu->actions().count()));
+            QObject::connect(menu, &QMenu::aboutToHide, nm_menu_prewarm);
+            break;
+        }
+    }
 
     return AbstractNickelMenuController_createMenuTextItem(_this, menu, label, checkable, checked, thingy);
 }
 
-QString nm_menu_pixmap(const char *custom, const char *custom_temp_out, const char *fallback) {
-    if (!custom || !custom_temp_out)
+// NM_MENU_PIXMAP_CACHE is where the scaled custom pixmaps are kept (it should
+// be on a tmpfs).
+#ifndef NM_MENU_PIXMAP_CACHE
+#define NM_MENU_PIXMAP_CACHE "/tmp/nm_menu_pixmap"
+#endif
+
+// nm_menu_pixmap returns the path to the custom pixmap scaled to the size of the
+// fallback one, or the fallback if there isn't a custom one or it can't be
+// loaded. The scaled pixmaps are cached by the source path, its modification
+// time and size, and the target size.
+QString nm_menu_pixmap(const char *custom, const char *fallback) {
+    if (!custom)
         return QString(fallback);
 
-    QImage a;
-    if (!a.load(QString(custom))) {
-        NM_LOG("nm_menu_pixmap: error loading '%s', falling back to '%s': %s", custom, fallback, QFile::exists(custom) ? "failed to load image" : "image does not exist");
+    QFileInfo fi(QString::fromUtf8(custom));
+    if (!fi.isFile()) {
+        NM_LOG("nm_menu_pixmap: error loading '%s', falling back to '%s': image does not exist", custom, fallback);
         return QString(fallback);
     }
 
-    QPixmap b;
-    if (!b.load(QString(fallback))) {
+    QSize size = QImageReader(QString(fallback)).size(); // this only reads the header
+    if (!size.isValid()) {
         NM_LOG("nm_menu_pixmap: error loading default pixmap '%s': %s", fallback, QFile::exists(fallback) ? "failed to load image" : "image does not exist");
         return QString(fallback);
     }
 
-    QImage c = a.scaled(b.size(), Qt::KeepAspectRatio, Qt::SmoothTransformation);
-    NM_LOG("nm_menu_pixmap: resized '%s' to match '%s' (%dx%d): %dx%d", custom, fallback, b.size().width(), b.size().height(), c.size().width(), c.size().height());
+    // <source>-<target size>-<source version>.png, so older versions can be removed
+    QString prefix = QString::fromLatin1(QCryptographicHash::hash(fi.absoluteFilePath().toUtf8(), QCryptographicHash::Md5).toHex().left(16))
+        + QStringLiteral("-%1x%2-").arg(size.width()).arg(size.height());
+    QString out = QStringLiteral(NM_MENU_PIXMAP_CACHE "/") + prefix
+        + QStringLiteral("%1-%2.png").arg(fi.lastModified().toMSecsSinceEpoch(), 0, 16).arg(fi.size(), 0, 16);
 
-    if (!c.save(QString(custom_temp_out), "PNG")) {
-        NM_LOG("nm_menu_pixmap: error saving resized pixmap to '%s'", custom_temp_out);
+    if (QFile::exists(out)) {
+        NM_LOG("nm_menu_pixmap: using cached '%s' for '%s'", qPrintable(out), custom);
+        return out;
+    }
+
+    QImage a;
+    if (!a.load(fi.filePath())) {
+        NM_LOG("nm_menu_pixmap: error loading '%s', falling back to '%s': failed to load image", custom, fallback);
+        return QString(fallback);
+    }
+
+    QImage c = a.scaled(size, Qt::KeepAspectRatio, Qt::SmoothTransformation);
+    NM_LOG("nm_menu_pixmap: resized '%s' to match '%s' (%dx%d): %dx%d", custom, fallback, size.width(), size.height(), c.size().width(), c.size().height());
+
+    QDir dir(QStringLiteral(NM_MENU_PIXMAP_CACHE));
+    if (!dir.mkpath(QStringLiteral("."))) {
+        NM_LOG("nm_menu_pixmap: error creating '%s'", NM_MENU_PIXMAP_CACHE);
         return QString(fallback);
     }
 
-    return QString(custom_temp_out);
+    for (const QFileInfo &old : dir.entryInfoList(QStringList(prefix + QStringLiteral("*")), QDir::Files))
+        QFile::remove(old.filePath());
+
+    // write it atomically, since another view may be using the same one
+    QString tmp = out + QStringLiteral(".tmp");
+    if (!c.save(tmp, "PNG") || rename(QFile::encodeName(tmp).constData(), QFile::encodeName(out).constData())) {
+        NM_LOG("nm_menu_pixmap: error saving resized pixmap to '%s'", qPrintable(out));
+        QFile::remove(tmp);
+        return QString(fallback);
+    }
+
+    return out;
 }
 
 static const char *nm_main_menu_config(int index, const char *option) {
@@ -285,7 +418,6 @@ static void main_nav_button_configure(MainNavButton *btn, const char *label, con
     if (icon || icon_fallback) {
         QString pixmap = nm_menu_pixmap(
             icon,
-            "/tmp/nm_menu.png",
             icon_fallback
         );
         if (!pixmap.isEmpty()) {
@@ -296,20 +428,202 @@ static void main_nav_button_configure(MainNavButton *btn, const char *label, con
     if (icon_active || icon_active_fallback) {
         QString pixmap = nm_menu_pixmap(
             icon_active,
-            "/tmp/nm_menu.png",
             icon_active_fallback
         );
         if (!pixmap.isEmpty()) {
             MainNavButton_setActivePixmap(btn, pixmap);
         }
     }
+}
+
+// nm_menu_main_nav_* is the menu for the bottom nav button (15505+). It is kept
+// (hidden) between taps, and only rebuilt if the main menu items changed, since
+// building it is slow. Note: only used from the GUI thread.
+static QPointer<MainNavButton> nm_menu_main_nav_btn;
+static NickelTouchMenu         *nm_menu_main_nav_cached     = nullptr;
+static int                     nm_menu_main_nav_cached_rev = -1;
+static QByteArray              nm_menu_main_nav_cached_sig;
+
+// nm_menu_main_nav returns the menu for the bottom nav button, updated to match
+// the specified config revision. On error, nm_err is set and nullptr is
+// returned.
+static NickelTouchMenu *nm_menu_main_nav(int rev) {
+    NM_TRACE_SCOPE(menu_main_nav, NULL);
+    size_t items_n;
+    nm_menu_item_t **items = nm_global_config_items(&items_n);
 
-    if (icon || icon_fallback || icon_active || icon_active_fallback) {
-        QFile::remove("/tmp/nm_menu.png");
+    if (!items)
+        NM_ERR_RET(nullptr, "Failed to get menu items (this might be a bug).");
+
+    NickelTouchMenu *menu = nm_menu_main_nav_cached;
+    if (menu && rev != nm_menu_main_nav_cached_rev) {
+        QByteArray sig;
+        for (size_t i = 0; i < items_n; i++) {
+            if (items[i]->loc == NM_MENU_LOCATION(main)) {
+                sig += nm_menu_item_key(items[i]);
+                sig += items[i]->lbl;
+                sig += '\1';
+            }
+        }
+        if (sig == nm_menu_main_nav_cached_sig) {
+            NM_LOG("main menu items are unchanged, updating items of cached menu");
+            size_t i = 0;
+            for (QAction *ac : menu->actions()) {
+                if (ac->isSeparator())
+                    continue;
+                while (items[i]->loc != NM_MENU_LOCATION(main))
+                    i++;
+                ac->setProperty("nm_item", QVariant::fromValue(reinterpret_cast<void*>(items[i++])));
+            }
+            nm_menu_main_nav_cached_rev = rev;
+        } else {
+            NM_LOG("main menu items changed, discarding cached menu");
+            menu->deleteLater();
+            menu = nm_menu_main_nav_cached = nullptr;
+        }
     }
+
+    if (menu) {
+        NM_LOG("using cached menu");
+        return menu;
+    }
+
+    NM_LOG("building menu");
+
+    menu = reinterpret_cast<NickelTouchMenu*>(calloc(1, 512)); // about 3x larger than the largest menu I've seen in 15505 (most inherit from NickelTouchMenu) to be on the safe side
+    if (!menu)
+        NM_ERR_RET(nullptr, "Failed to allocate memory for menu.");
+
+    NickelTouchMenu_NickelTouchMenu(menu, nullptr, 3);
+
+    QByteArray sig;
+    for (size_t i = 0; i < items_n; i++) {
+        nm_menu_item_t *it = items[i];
+        if (it->loc != NM_MENU_LOCATION(main))
+            continue;
+
+        sig += nm_menu_item_key(it);
+        sig += it->lbl;
+        sig += '\1';
+
+        NM_LOG("adding item '%s'...", it->lbl);
+
+        // based on _ZN23SelectionMenuController18createMenuTextItemEP7QWidgetRK7QString
+        // (also see _ZN28AbstractNickelMenuController18createMenuTextItemEP5QMenuRK7QStringbbS4_, which seems to do the gestures itself instead of calling registerForTapGestures)
+
+        MenuTextItem *mti = reinterpret_cast<MenuTextItem*>(calloc(1, 256)); // about 3x larger than the 15505 size (92)
+        if (!it) {
+            menu->deleteLater();
+            NM_ERR_RET(nullptr, "Failed to allocate memory for menu item.");
+        }
+
+        MenuTextItem_MenuTextItem(mti, menu, false, true);
+        MenuTextItem_setText(mti, QString::fromUtf8(it->lbl));
+        MenuTextItem_registerForTapGestures(mti); // this only makes the MenuTextItem::tapped signal connect so it highlights on tap, doesn't apply to the QAction::triggered below (which needs another GestureReceiver somewhere)
+
+        // based on _ZN22AbstractMenuController12createActionEP5QMenuP7QWidgetbbb
+
+        QWidgetAction *ac = new QWidgetAction(menu);
+        ac->setDefaultWidget(mti);
+        ac->setEnabled(true);
+
+        menu->addAction(ac);
+
+        QWidget::connect(ac, &QAction::triggered, menu, &QMenu::hide);
+
+        if (i != items_n-1)
+            menu->addSeparator();
+
+        // shim so we don't need to deal with GestureReceiver directly like _ZN28AbstractNickelMenuController18createMenuTextItemEP5QMenuRK7QStringbbS4_ does
+        // (similar to _ZN23SelectionMenuController11addMenuItemEP17SelectionMenuViewP12MenuTextItemPKc)
+
+        if (!QWidget::connect(mti, SIGNAL(tapped(bool)), ac, SIGNAL(triggered()))) {
+            NM_LOG("could not handle touch events for menu item (connection of SIGNAL(tapped(bool)) on MenuTextItem to SIGNAL(triggered()) on QWidgetAction failed)");
+            menu->deleteLater();
+            NM_ERR_RET(nullptr, "Could not attach touch event handlers to menu item (this is a bug).");
+        }
+
+        // event handler
+
+        ac->setProperty("nm_item", QVariant::fromValue(reinterpret_cast<void*>(it)));
+        QObject::connect(ac, &QAction::triggered, [ac](bool) {
+            nm_menu_item_t *it = reinterpret_cast<nm_menu_item_t*>(ac->property("nm_item").value<void*>());
+            NM_LOG("item '%s' pressed...", it->lbl);
+            nm_menu_item_do(it, NULL, NULL);
+            NM_LOG("done");
+        }); // note: the item is updated whenever the config revision changes, so it is always valid when the menu is shown
+    }
+
+    // the items may have been changed by the action, or it may have been waiting
+    // for the menu to close
+    QObject::connect(menu, &QMenu::aboutToHide, nm_menu_prewarm);
+
+    menu->ensurePolished();
+
+    nm_menu_main_nav_cached     = menu;
+    nm_menu_main_nav_cached_rev = rev;
+    nm_menu_main_nav_cached_sig = sig;
+    return menu;
+}
+
+// NM_MENU_PREWARM_RETRY_MS is how long to wait before trying to prewarm again
+// if a menu was open.
+#ifndef NM_MENU_PREWARM_RETRY_MS
+#define NM_MENU_PREWARM_RETRY_MS 1000
+#endif
+
+// note: only used from the GUI thread
+static QTimer            *nm_menu_prewarm_timer    = nullptr;
+static QSocketNotifier   *nm_menu_prewarm_notifier = nullptr;
+static QPointer<QWidget> nm_menu_selection_view;            // the last SelectionMenuView items were added to, since they reference the items directly
+
+// nm_menu_prewarm_run updates the config and generators, and rebuilds the
+// bottom nav menu if it has changed. The widgets for the menus Nickel owns are
+// still updated when they are shown, since we can't tell if their controllers
+// are still alive, but that only needs to reconcile the items now.
+static void nm_menu_prewarm_run() {
+    NM_TRACE_SCOPE(menu_prewarm, NULL);
+    // the items referenced by an open menu must remain valid
+    if (QApplication::activePopupWidget() || (nm_menu_selection_view && nm_menu_selection_view->isVisible())) {
+        NM_LOG("prewarm: a menu is open, trying again later");
+        nm_menu_prewarm_timer->start(NM_MENU_PREWARM_RETRY_MS);
+        return;
+    }
+
+    NM_LOG("prewarm: checking for config updates");
+    int rev = nm_global_config_update();
+    if (nm_err_peek())
+        NM_LOG("prewarm: ... error: %s", nm_err());
+    NM_LOG("prewarm: revision = %d", rev);
+
+    if (nm_menu_main_nav_btn && NickelTouchMenu_NickelTouchMenu && MenuTextItem_MenuTextItem && MenuTextItem_setText && MenuTextItem_registerForTapGestures) {
+        if (!nm_menu_main_nav(rev))
+            NM_LOG("prewarm: failed to get menu: %s", nm_err());
+    }
+
+    // the inotify instance is only created once a generator needs it
+    int fd = nm_generator_watch_fileno();
+    if (!nm_menu_prewarm_notifier && fd != -1) {
+        nm_menu_prewarm_notifier = new QSocketNotifier(fd, QSocketNotifier::Read);
+        QObject::connect(nm_menu_prewarm_notifier, &QSocketNotifier::activated, [](int) {
+            if (nm_generator_watch_poll())
+                nm_menu_prewarm();
+        });
+    }
+}
+
+extern "C" void nm_menu_prewarm() {
+    if (!nm_menu_prewarm_timer) {
+        nm_menu_prewarm_timer = new QTimer();
+        nm_menu_prewarm_timer->setSingleShot(true);
+        QObject::connect(nm_menu_prewarm_timer, &QTimer::timeout, nm_menu_prewarm_run);
+    }
+    if (!nm_menu_prewarm_timer->isActive())
+        nm_menu_prewarm_timer->start(0); // i.e. once there aren't any other events to handle
 }
 
 extern "C" __attribute__((visibility("default"))) void _nm_menu_hook2(MainNavView *_this, QWidget *parent) {
+    NM_TRACE_SCOPE(hook_main_nav, NULL);
     NM_LOG("MainNavView::MainNavView(%p, %p)", _this, parent);
     MainNavView_MainNavView(_this, parent);
 
@@ -382,6 +696,8 @@ extern "C" __attribute__((visibility("default"))) void _nm_menu_hook2(MainNavVie
     }
     sh->setVisible(false);
 
+    nm_menu_main_nav_btn = btn;
+
     QWidget::connect(sh, &QPushButton::pressed, [btn] {
         if (!NickelTouchMenu_NickelTouchMenu || !MenuTextItem_MenuTextItem || !MenuTextItem_setText || !MenuTextItem_registerForTapGestures) {
             NM_LOG("could not find required NickelTouchMenu and MenuTextItem symbols for generating menu");
@@ -393,84 +709,16 @@ extern "C" __attribute__((visibility("default"))) void _nm_menu_hook2(MainNavVie
         int rev = nm_global_config_update();
         NM_LOG("revision = %d", rev);
 
-        NM_LOG("building menu");
-
-        size_t items_n;
-        nm_menu_item_t **items = nm_global_config_items(&items_n);
-
-        if (!items) {
-            NM_LOG("failed to get menu items");
-            ConfirmationDialogFactory_showOKDialog(QLatin1String("NickelMenu"), QLatin1String("Failed to get menu items (this might be a bug)."));
-            return;
-        }
-
-        NickelTouchMenu *menu = reinterpret_cast<NickelTouchMenu*>(calloc(1, 512)); // about 3x larger than the largest menu I've seen in 15505 (most inherit from NickelTouchMenu) to be on the safe side
+        NickelTouchMenu *menu = nm_menu_main_nav(rev);
         if (!menu) {
-            NM_LOG("failed to allocate memory for menu");
-            ConfirmationDialogFactory_showOKDialog(QLatin1String("NickelMenu"), QLatin1String("Failed to allocate memory for menu."));
+            const char *err = nm_err();
+            NM_LOG("failed to get menu: %s", err);
+            ConfirmationDialogFactory_showOKDialog(QLatin1String("NickelMenu"), QString::fromUtf8(err));
             return;
         }
 
-        NickelTouchMenu_NickelTouchMenu(menu, nullptr, 3);
-
-        for (size_t i = 0; i < items_n; i++) {
-            nm_menu_item_t *it = items[i];
-            if (it->loc != NM_MENU_LOCATION(main))
-                continue;
-
-            NM_LOG("adding item '%s'...", it->lbl);
-
-            // based on _ZN23SelectionMenuController18createMenuTextItemEP7QWidgetRK7QString
-            // (also see _ZN28AbstractNickelMenuController18createMenuTextItemEP5QMenuRK7QStringbbS4_, which seems to do the gestures itself instead of calling registerForTapGestures)
-
-            MenuTextItem *mti = reinterpret_cast<MenuTextItem*>(calloc(1, 256)); // about 3x larger than the 15505 size (92)
-            if (!it) {
-                NM_LOG("failed to allocate memory for config item");
-                menu->deleteLater();
-                ConfirmationDialogFactory_showOKDialog(QLatin1String("NickelMenu"), QLatin1String("Failed to allocate memory for menu item."));
-                return;
-            }
-
-            MenuTextItem_MenuTextItem(mti, menu, false, true);
-            MenuTextItem_setText(mti, QString::fromUtf8(it->lbl));
-            MenuTextItem_registerForTapGestures(mti); // this only makes the MenuTextItem::tapped signal connect so it highlights on tap, doesn't apply to the QAction::triggered below (which needs another GestureReceiver somewhere)
-
-            // based on _ZN22AbstractMenuController12createActionEP5QMenuP7QWidgetbbb
-
-            QWidgetAction *ac = new QWidgetAction(menu);
-            ac->setDefaultWidget(mti);
-            ac->setEnabled(true);
-
-            menu->addAction(ac);
-
-            QWidget::connect(ac, &QAction::triggered, menu, &QMenu::hide);
-
-            if (i != items_n-1)
-                menu->addSeparator();
-
-            // shim so we don't need to deal with GestureReceiver directly like _ZN28AbstractNickelMenuController18createMenuTextItemEP5QMenuRK7QStringbbS4_ does
-            // (similar to _ZN23SelectionMenuController11addMenuItemEP17SelectionMenuViewP12MenuTextItemPKc)
-
-            if (!QWidget::connect(mti, SIGNAL(tapped(bool)), ac, SIGNAL(triggered()))) {
-                NM_LOG("could not handle touch events for menu item (connection of SIGNAL(tapped(bool)) on MenuTextItem to SIGNAL(triggered()) on QWidgetAction failed)");
-                menu->deleteLater();
-                ConfirmationDialogFactory_showOKDialog(QLatin1String("NickelMenu"), QLatin1String("Could not attach touch event handlers to menu item (this is a bug)."));
-                return;
-            }
-
-            // event handler
-
-            QObject::connect(ac, &QAction::triggered, [it](bool) {
-                NM_LOG("item '%s' pressed...", it->lbl);
-                nm_menu_item_do(it, NULL, NULL);
-                NM_LOG("done");
-            }); // note: we're capturing by value, i.e. the pointer to the global variable, rather then the stack variable, so this is safe
-        }
-
         NM_LOG("showing menu");
 
-        QWidget::connect(menu, &QMenu::aboutToHide, menu, &QWidget::deleteLater);
-
         menu->ensurePolished();
         menu->popup(btn->mapToGlobal(btn->geometry().topRight() - QPoint(0, menu->sizeHint().height())));
     });
@@ -479,6 +727,8 @@ extern "C" __attribute__((visibility("default"))) void _nm_menu_hook2(MainNavVie
     _this->ensurePolished();
 
     NM_LOG("Added button.");
+
+    nm_menu_prewarm(); // build the menu before it is tapped the first time
 }
 
 // _nm_menu_hook4_item gets/sets the current menu item. It must only be called
@@ -494,7 +744,23 @@ nm_menu_item_t *_nm_menu_hook4_item(nm_menu_item_t *it) {
     return tmp;
 }
 
+// nm_selmenu_direct checks whether a selection menu item can be run without
+// going through lookupWikipedia to get the selection. There isn't a way to get
+// the selection directly, so this is only possible if none of the actions use
+// it. Since the selection menu is then hidden by us rather than by Nickel, this
+// is opt-in (experimental:menu_selection_direct:1).
+static bool nm_selmenu_direct(nm_menu_item_t *it) {
+    const char *opt = nm_global_config_experimental("menu_selection_direct");
+    if (!opt || strcmp(opt, "1"))
+        return false;
+    for (nm_menu_action_t *cur = it->action; cur; cur = cur->next)
+        if (!nm_argtemplate_static(cur->arg))
+            return false;
+    return true;
+}
+
 extern "C" __attribute__((visibility("default"))) void _nm_menu_hook3(SelectionMenuController *_this, SelectionMenuView* smv, MenuTextItem* mti, const char *slot) {
+    NM_TRACE_SCOPE(hook_selection, NULL);
     NM_LOG("hook3: %p %p %p %s", _this, smv, mti, slot);
     SelectionMenuController_addMenuItem(_this, smv, mti, slot);
 
@@ -565,91 +831,86 @@ extern "C" __attribute__((visibility("default"))) void _nm_menu_hook3(SelectionM
         }
         sh->setVisible(false);
 
-        QObject::connect(sh, &QPushButton::pressed, [_this, it]() {
+        QObject::connect(sh, &QPushButton::pressed, [_this, smv, it]() {
             NM_LOG("item '%s' pressed...", it->lbl);
+            if (nm_selmenu_direct(it)) {
+                NM_LOG("item doesn't use the selection, hiding the selection menu and running it directly");
+                smv->hide();
+                nm_menu_item_do(it, NULL, NULL);
+                NM_LOG("done");
+                return;
+            }
             _nm_menu_hook4_item(it); // this is safe since it is a pointer captured by value
             NM_LOG("triggering lookupWikipedia() slot");
             SelectionMenuController_lookupWikipedia(_this);
         });
 
         SelectionMenuView_addMenuItem(smv, mti);
+        nm_menu_selection_view = smv;
     }
 }
 
+// nm_selmenu_argtransform_data_t is the context for the variables in the
+// selection menu argument templates. The ones which aren't passed to
+// doWikipediaSearch are resolved the first time they are used in the chain.
 typedef struct {
     QString const& selection;
+    QString const& locale;
+    bool           book;       // whether the book info has been resolved
+    QString        book_path;
+    QString        book_title;
 } nm_selmenu_argtransform_data_t;
 
-char *_nm_selmenu_argtransform(void *data, const char *arg) {
+static const QString *_nm_selmenu_argtransform_resolve(void *data, nm_argtemplate_var_t var) {
     nm_selmenu_argtransform_data_t *d = (nm_selmenu_argtransform_data_t*)(data);
 
-    QString src = QString::fromUtf8(arg), res;
-    QRegularExpression re = QRegularExpression("\\{([1])\\|([aAfnsSuwx]*)\\|([\"$%]*)\\}");
-
-    for (QStringRef x = src.midRef(0); x.length() > 0;) {
-        QRegularExpressionMatch m = re.match(x.toString());
-
-        if (!m.hasMatch()) {
-            res += x;
-            x = x.mid(x.length());
-            continue;
-        }
-
-        QString tmp;
-
-        for (int k = 0; k < m.capturedLength(1); k++) {
-            switch (m.capturedRef(1).at(k).toLatin1()) {
-            case '1': tmp = d->selection; break;
-            }
-        }
-
-        for (int k = 0; k < m.capturedLength(2); k++) {
-            switch (m.capturedRef(2).at(k).toLatin1()) {
-            case 'a': tmp = tmp.toLower(); break;
-            case 'A': tmp = tmp.toUpper(); break;
-            case 'f': tmp = tmp.split(QRegularExpression("\\s")).first(); break;
-            case 'n': tmp = tmp.remove(QRegularExpression("[^0-9a-zA-Z]")); break;
-            case 's': tmp = tmp.trimmed(); break;
-            case 'S': tmp = tmp.simplified(); break;
-            case 'u': if (tmp.length() == 0) { nm_err_set("argtransform: empty substitution result for %s", qPrintable(m.capturedRef(0).toString())); return NULL; }; break;
-            case 'w': tmp = tmp.remove(QRegularExpression("\\s")); break;
-            case 'x': tmp = tmp.replace(QRegularExpression("\\s"), "_"); break;
-            }
+    switch (var) {
+    case NM_ARGTEMPLATE_VAR(selection):
+        return &d->selection;
+    case NM_ARGTEMPLATE_VAR(locale):
+        return &d->locale;
+    case NM_ARGTEMPLATE_VAR(book_path):
+    case NM_ARGTEMPLATE_VAR(book_title):
+        if (!d->book) {
+            char *id, *title;
+            if (nm_generator_library_current(&id, &title))
+                NM_ERR_RET(NULL, "argtransform: could not get the current book: %s", nm_err());
+            d->book_path  = QString::fromUtf8(id);
+            d->book_title = QString::fromUtf8(title);
+            if (d->book_path.startsWith(QLatin1String("file://")))
+                d->book_path.remove(0, strlen("file://"));
+            d->book = true;
+            free(id);
+            free(title);
+            NM_LOG("argtransform: current book is '%s' (%s)", qPrintable(d->book_title), qPrintable(d->book_path));
         }
+        return var == NM_ARGTEMPLATE_VAR(book_path) ? &d->book_path : &d->book_title;
+    default:
+        NM_ERR_RET(NULL, "argtransform: unknown variable %d (this is a bug)", var);
+    }
+}
 
-        for (int k = 0; k < m.capturedLength(3); k++) {
-            switch (m.capturedRef(3).at(k).toLatin1()) {
-            case '"':
-                tmp = tmp
-                    .replace("\"", "\\\"")
-                    .replace("\n", "\\n")
-                    .replace("\b", "\\b")
-                    .replace("\t", "\\t")
-                    .replace("\f", "\\f")
-                    .replace("\r", "\\r")
-                    .replace("\\", "\\\\");
-                break;
-            case '$':
-                tmp = tmp.replace("'", "'\"'\"'");
-                break;
-            case '%':
-                tmp = QUrl::toPercentEncoding(tmp);
-                break;
-            }
-        }
+char *_nm_selmenu_argtransform(void *data, const char *arg) {
+    // the templates are parsed the first time they're used for each config
+    // revision (the argument pointers stay valid until it changes)
+    static QHash<const char*, nm_argtemplate_t> tmpls;
+    static int tmpls_rev = -1;
+    if (tmpls_rev != nm_global_config_rev()) {
+        tmpls.clear();
+        tmpls_rev = nm_global_config_rev();
+    }
 
-        res += x.left(m.capturedStart());
-        res += tmp;
-        x = x.mid(m.capturedEnd());
+    QHash<const char*, nm_argtemplate_t>::iterator t = tmpls.find(arg);
+    if (t == tmpls.end()) {
+        t = tmpls.insert(arg, nm_argtemplate_t());
+        nm_argtemplate_parse(arg, &t.value());
     }
 
-    char *x = strdup(res.toUtf8().data());
-    if (!x)
-        nm_err_set("argtransform: could not allocate memory: %m");
-    return x;
+    return nm_argtemplate_apply(&t.value(), _nm_selmenu_argtransform_resolve, data);
 }
 
 extern "C" __attribute__((visibility("default"))) void _nm_menu_hook4(WebSearchMixinBase *_this, QString const& selection, QString const& locale) {
+    NM_TRACE_SCOPE(hook_search, NULL);
     NM_LOG("hook4: %p %s %s", _this, qPrintable(selection), qPrintable(locale));
 
     nm_menu_item_t *it = _nm_menu_hook4_item(NULL);
@@ -660,14 +921,50 @@ extern "C" __attribute__((visibility("default"))) void _nm_menu_hook4(WebSearchM
     }
 
     NM_LOG("continuing execution of item %p (%s)", it, it->lbl);
-    nm_selmenu_argtransform_data_t data = (nm_selmenu_argtransform_data_t){
-        .selection = selection,
+    nm_selmenu_argtransform_data_t data = {
+        .selection  = selection,
+        .locale     = locale,
+        .book       = false,
+        .book_path  = QString(),
+        .book_title = QString(),
     };
-    nm_menu_item_do(it, _nm_selmenu_argtransform, (void*)(&data)); // this is safe since data will not be used after this returns
+    nm_menu_item_do(it, _nm_selmenu_argtransform, (void*)(&data)); // this is safe since data (and the variables cached in it) will not be used after this returns
     NM_LOG("done");
 }
 
+static QByteArray nm_menu_item_key(nm_menu_item_t *it) {
+    QByteArray key;
+    for (nm_menu_action_t *cur = it->action; cur; cur = cur->next) {
+        key += QByteArray::number(reinterpret_cast<quintptr>(cur->act), 16);
+        key += cur->on_success ? '+' : '-';
+        key += cur->on_failure ? '+' : '-';
+        key += cur->arg;
+        key += '\0';
+    }
+    return key;
+}
+
+// nm_menu_injected_t is an item added to a menu by _nm_menu_inject.
+typedef struct {
+    nm_menu_item_t *it;
+    QByteArray     key;
+    QAction        *action; // nullptr if it needs to be created
+    QAction        *sep;
+} nm_menu_injected_t;
+
+// nm_menu_move moves action (if needed) so it's directly before next (or at
+// the end if nullptr).
+static void nm_menu_move(QMenu *menu, QAction *action, QAction *next) {
+    QList<QAction*> actions = menu->actions();
+    int i = actions.indexOf(action);
+    if (next ? (i + 1 < actions.count() && actions.at(i + 1) == next) : (i == actions.count() - 1))
+        return;
+    menu->removeAction(action);
+    menu->insertAction(next, action);
+}
+
 void _nm_menu_inject(void *nmc, QMenu *menu, nm_menu_location_t loc, int at) {
+    NM_TRACE_SCOPE(menu_inject, NULL);
     NM_LOG("inject %d @ %d", loc, at);
 
     int rev_o = menu->property("nm_config_rev").toInt();
@@ -678,26 +975,26 @@ void _nm_menu_inject(void *nmc, QMenu *menu, nm_menu_location_t loc, int at) {
 
     NM_LOG("checking for existing items added by nm");
 
+    // note: the items are reconciled with the existing ones rather than
+    // replacing all of them, since each one needs to go through Nickel, and
+    // only a few of them usually change (e.g. a single generator)
+    QHash<QByteArray, nm_menu_injected_t> existing;
+    QAction *before = nullptr;
+    int native = 0;
     for (auto action : menu->actions()) {
         if (action->property("nm_action") == true) {
             if (rev_o == rev_n)
                 return; // already added items, menu is up to date
-            menu->removeAction(action);
-            delete action;
+            QVariant key = action->property("nm_item_key");
+            if (key.isValid())
+                existing.insert(key.toByteArray(), {nullptr, key.toByteArray(), action, action->property("nm_item_sep").value<QAction*>()});
+        } else if (native++ == at) {
+            before = action;
         }
     }
 
-    NM_LOG("getting insertion point");
-
-    auto actions = menu->actions();
-    auto before = at < actions.count()
-        ? actions.at(at)
-        : nullptr;
-
     if (before == nullptr)
-        NM_LOG("it seems the original item to add new ones before was never actually added to the menu (number of items when the action was created is %d, current is %d), appending to end instead", at, actions.count());
-
-    NM_LOG("injecting new items");
+        NM_LOG("it seems the original item to add new ones before was never actually added to the menu (number of items when the action was created is %d, current is %d), appending to end instead", at, native);
 
     size_t items_n;
     nm_menu_item_t **items = nm_global_config_items(&items_n);
@@ -707,38 +1004,211 @@ void _nm_menu_inject(void *nmc, QMenu *menu, nm_menu_location_t loc, int at) {
         return;
     }
 
-    // if it segfaults in createMenuTextItem, it's likely because
-    // AbstractNickelMenuController is invalid, which shouldn't happen while the
-    // menu which we added the signal from still can be shown... (but
-    // theoretically, it's possible)
+    NM_LOG("reconciling items");
+    NM_TRACE_SCOPE(menu_inject_items, NULL);
 
+    QList<nm_menu_injected_t> injected;
+    QHash<QByteArray, int> dups;
     for (size_t i = 0; i < items_n; i++) {
         nm_menu_item_t *it = items[i];
         if (it->loc != loc)
             continue;
 
-        NM_LOG("adding item '%s'...", it->lbl);
+        QByteArray key = nm_menu_item_key(it);
+        if (int n = dups[key]++)
+            key += '#' + QByteArray::number(n);
+
+        nm_menu_injected_t inj = existing.take(key);
+        inj.it  = it;
+        inj.key = key;
+
+        if (inj.action) {
+            QString lbl = QString::fromUtf8(it->lbl);
+            if (inj.action->property("nm_item_lbl").toString() != lbl) {
+                QWidgetAction *wa = qobject_cast<QWidgetAction*>(inj.action);
+                if (MenuTextItem_setText && wa && wa->defaultWidget()) {
+                    NM_LOG("updating item label '%s'...", it->lbl);
+                    MenuTextItem_setText(wa->defaultWidget(), lbl);
+                    inj.action->setProperty("nm_item_lbl", lbl);
+                    NM_STATS_COUNT(menu_item_updated, 1);
+                } else {
+                    existing.insert(key + "#replaced", inj); // can't update it in place, so replace it
+                    inj.action = nullptr;
+                    inj.sep    = nullptr;
+                }
+            }
+        }
+        injected.append(inj);
+    }
 
-        MenuTextItem* item = AbstractNickelMenuController_createMenuTextItem(nmc, menu, QString::fromUtf8(it->lbl), false, false, "");
-        QAction* action = AbstractNickelMenuController_createAction_before(before, loc, i == items_n-1, nmc, menu, item, true, true, true);
+    for (const nm_menu_injected_t &inj : existing) {
+        NM_LOG("removing item %p...", inj.action);
+        NM_STATS_COUNT(menu_item_removed, 1);
+        for (QAction *action : {inj.action, inj.sep}) {
+            if (action) {
+                menu->removeAction(action);
+                delete action;
+            }
+        }
+    }
 
-        QObject::connect(action, &QAction::triggered, [it](bool){
-            NM_LOG("item '%s' pressed...", it->lbl);
-            nm_menu_item_do(it, NULL, NULL);
-            NM_LOG("done");
-        }); // note: we're capturing by value, i.e. the pointer to the global variable, rather then the stack variable, so this is safe
+    // if it segfaults in createMenuTextItem, it's likely because
+    // AbstractNickelMenuController is invalid, which shouldn't happen while the
+    // menu which we added the signal from still can be shown... (but
+    // theoretically, it's possible)
+
+    // lay them out from the end, so each one only needs to be before the next,
+    // and insert consecutive new ones in a single batch (usually, all of them
+    // are new or none of them are)
+    menu->setUpdatesEnabled(false);
+
+    QList<QAction*> snap = menu->actions();
+    QHash<QAction*, int> snap_idx;
+    snap_idx.reserve(snap.count());
+    for (int i = 0; i < snap.count(); i++)
+        snap_idx.insert(snap.at(i), i);
+    bool moved = false;
+
+    QAction *next = before;      // the action which will be after the current item
+    QList<QAction*> batch;       // new actions to insert before next
+    for (int i = injected.count() - 1; i >= 0; i--) {
+        nm_menu_injected_t &inj = injected[i];
+        bool last = i == injected.count() - 1;
+
+        // the main menu uses a different separator for the last item
+        if (inj.action && loc == NM_MENU_LOCATION(main) && inj.action->property("nm_item_last").toBool() != last) {
+            NM_LOG("replacing item '%s' since it is %s the last one...", inj.it->lbl, last ? "now" : "no longer");
+            for (QAction *action : {inj.action, inj.sep}) {
+                if (action) {
+                    menu->removeAction(action);
+                    delete action;
+                }
+            }
+            inj.action = nullptr;
+            inj.sep    = nullptr;
+            moved      = true; // the snapshot is out of date
+        }
+
+        if (!inj.action) {
+            NM_LOG("adding item '%s'...", inj.it->lbl);
+            NM_STATS_COUNT(menu_item_added, 1);
+
+            MenuTextItem* item = AbstractNickelMenuController_createMenuTextItem(nmc, menu, QString::fromUtf8(inj.it->lbl), false, false, "");
+            QAction* action = AbstractNickelMenuController_createAction_detached(loc, last, nmc, menu, item, true, true, true, &inj.sep);
+            inj.action = action;
+
+            action->setProperty("nm_item_key", inj.key);
+            action->setProperty("nm_item_lbl", QString::fromUtf8(inj.it->lbl));
+            action->setProperty("nm_item_last", last);
+            action->setProperty("nm_item_sep", QVariant::fromValue(inj.sep));
+
+            QObject::connect(action, &QAction::triggered, [action](bool){
+                nm_menu_item_t *it = reinterpret_cast<nm_menu_item_t*>(action->property("nm_item").value<void*>());
+                NM_LOG("item '%s' pressed...", it->lbl);
+                nm_menu_item_do(it, NULL, NULL);
+                NM_LOG("done");
+            }); // note: the item is updated whenever the config revision changes, so it is always valid when the menu is shown
+
+            if (inj.sep)
+                batch.prepend(inj.sep);
+            batch.prepend(action);
+        } else {
+            // check whether it's still in the right spot using the snapshot
+            // (if nothing was moved, the only changes since then are
+            // insertions before next, which don't affect this)
+            QAction *tail = inj.sep ? inj.sep : inj.action;
+            int tail_idx = snap_idx.value(tail, -1);
+            bool in_place = !moved && tail_idx != -1
+                && (next ? snap_idx.value(next, -1) == tail_idx + 1 : tail_idx == snap.count() - 1)
+                && (!inj.sep || snap_idx.value(inj.action, -1) == tail_idx - 1);
+
+            if (!batch.isEmpty()) {
+                menu->insertActions(next, batch);
+                next = batch.first();
+                batch.clear();
+            }
+
+            if (!in_place) {
+                moved = true;
+                NM_STATS_COUNT(menu_item_moved, 1);
+                if (inj.sep) {
+                    nm_menu_move(menu, inj.sep, next);
+                    nm_menu_move(menu, inj.action, inj.sep);
+                } else {
+                    nm_menu_move(menu, inj.action, next);
+                }
+            }
+        }
+
+        inj.action->setProperty("nm_item", QVariant::fromValue(reinterpret_cast<void*>(inj.it)));
+        if (batch.isEmpty())
+            next = inj.action;
     }
+    if (!batch.isEmpty())
+        menu->insertActions(next, batch);
+
+    menu->setUpdatesEnabled(true);
 
     NM_LOG("updating config revision property");
     menu->setProperty("nm_config_rev", rev_n);
 }
 
+// nm_menu_item_copy returns a deep copy of a menu item, to be freed with
+// nm_menu_item_free.
+static nm_menu_item_t *nm_menu_item_copy(nm_menu_item_t *it) {
+    nm_menu_item_t *c = reinterpret_cast<nm_menu_item_t*>(calloc(1, sizeof(nm_menu_item_t)));
+    c->loc = it->loc;
+    c->lbl = strdup(it->lbl);
+    for (nm_menu_action_t *cur = it->action, **tail = &c->action; cur; cur = cur->next, tail = &(*tail)->next) {
+        *tail = reinterpret_cast<nm_menu_action_t*>(calloc(1, sizeof(nm_menu_action_t)));
+        (*tail)->arg        = strdup(cur->arg);
+        (*tail)->on_success = cur->on_success;
+        (*tail)->on_failure = cur->on_failure;
+        (*tail)->act        = cur->act;
+    }
+    return c;
+}
+
+static void nm_menu_item_free(nm_menu_item_t *it) {
+    for (nm_menu_action_t *cur = it->action, *tmp; cur; cur = tmp) {
+        tmp = cur->next;
+        free(cur->arg);
+        free(cur);
+    }
+    free(it->lbl);
+    free(it);
+}
+
 void nm_menu_item_do(nm_menu_item_t *it, nm_argtransform_t argtransform, void *argtransform_data) {
-    const char *err = NULL;
-    bool success = true;
-    int skip = 0;
+    nm_menu_item_run_t *run = new nm_menu_item_run_t();
+    run->it                = nm_menu_item_copy(it);
+    run->argtransform      = argtransform;
+    run->argtransform_data = argtransform_data;
+    run->cur               = run->it->action;
+    run->success           = true;
+    nm_menu_item_run(run);
+}
 
-    for (nm_menu_action_t *cur = it->action; cur; cur = cur->next) {
+static void nm_menu_item_resume(void *ctx) {
+    nm_menu_item_run_t *run = reinterpret_cast<nm_menu_item_run_t*>(ctx);
+    NM_LOG("resuming item '%s' after kfmon reply", run->it->lbl);
+    nm_menu_item_run(run);
+}
+
+// nm_menu_item_run_actions runs the remaining actions of a chain. It returns
+// false if it needs to wait for KFMon.
+static bool nm_menu_item_run_actions(nm_menu_item_run_t *run) {
+    nm_menu_item_t *it = run->it;
+    nm_argtransform_t argtransform = run->argtransform;
+    void *argtransform_data = run->argtransform_data;
+    const char *err = NULL; // note: this is always set again after resuming, since we resume at an action which will run
+    bool &success = run->success;
+    int &skip = run->skip;
+    NM_TRACE_SCOPE(item, it->lbl);
+    NM_STALL_SCOPE(item, it->lbl, NULL);
+
+    for (; run->cur; run->cur = run->cur->next) {
+        nm_menu_action_t *cur = run->cur;
         NM_LOG("action %p with argument %s : ", cur->act, cur->arg);
         NM_LOG("...success=%d ; on_success=%d on_failure=%d skip=%d", success, cur->on_success, cur->on_failure, skip);
 
@@ -753,7 +1223,22 @@ void nm_menu_item_do(nm_menu_item_t *it, nm_argtransform_t argtransform, void *a
         }
 
         nm_action_result_t *res = NULL;
-        if (!argtransform) {
+        uint64_t t = nm_trace_now();
+        size_t batch_n;
+        int batch_status;
+        if (!argtransform && (batch_n = nm_kfmon_batch_start(&run->batch, cur))) {
+            // kfmon actions (and any following ones which always run) are
+            // sent together without blocking the event loop while waiting
+            // for KFMon, and we continue at this action once they're done
+            NM_LOG("...waiting for %zu kfmon request(s)", batch_n);
+            nm_kfmon_post_batch_request(run->batch.reqs, batch_n, nm_menu_item_resume, run);
+            return false;
+        }
+        bool stall = nm_stall_enter(NM_STALL_SECTION(action), it->lbl, nm_action_name(cur->act));
+        if (nm_kfmon_batch_next(&run->batch, &batch_status)) {
+            NM_LOG("...using kfmon result %zu/%zu", run->batch.i, run->batch.n);
+            res = nm_kfmon_batch_result(cur->act, batch_status);
+        } else if (!argtransform) {
             res = cur->act(cur->arg);
         } else {
             NM_LOG("...applying argtransform");
@@ -765,6 +1250,13 @@ void nm_menu_item_do(nm_menu_item_t *it, nm_argtransform_t argtransform, void *a
             }
         }
         err = nm_err();
+        if (stall)
+            nm_stall_exit();
+        nm_trace_add(NM_TRACE_EVENT(action), t, nm_action_name(cur->act));
+        nm_stats_action(nm_action_name(cur->act), nm_trace_now() - t);
+        NM_STATS_COUNT(action_run, 1);
+        if (err)
+            NM_STATS_COUNT(action_error, 1);
 
         if (err == NULL && res && res->type == NM_ACTION_RESULT_TYPE_SKIP) {
             NM_LOG("...not updating success flag (value=%d) for skip result", success);
@@ -810,44 +1302,53 @@ void nm_menu_item_do(nm_menu_item_t *it, nm_argtransform_t argtransform, void *a
         NM_LOG("last action returned error %s", err);
         ConfirmationDialogFactory_showOKDialog(QString::fromUtf8(it->lbl), QString::fromUtf8(err));
     }
+
+    return true;
 }
 
-QAction *AbstractNickelMenuController_createAction_before(QAction *before, nm_menu_location_t loc, bool last_in_group, void *_this, QMenu *menu, QWidget *widget, bool close, bool enabled, bool separator) {
-    int n = menu->actions().count();
-    QAction* action = AbstractNickelMenuController_createAction(_this, menu, widget, /*close*/false, enabled, /*separator*/false);
+static void nm_menu_item_run(nm_menu_item_run_t *run) {
+    // note: the item is freed separately so it outlives the scopes above
+    if (nm_menu_item_run_actions(run)) {
+        nm_menu_item_free(run->it);
+        delete run;
+    }
+}
 
-    action->setProperty("nm_action", true);
+QAction *AbstractNickelMenuController_createAction_detached(nm_menu_location_t loc, bool last_in_group, void *_this, QMenu *menu, QWidget *widget, bool close, bool enabled, bool separator, QAction **sep_out) {
+    // createAction always adds it to the end of the menu it's given, so give
+    // it one which is never shown, and take it back from there (this is much
+    // cheaper than moving it around in the actual menu)
+    static QMenu *scratch = nullptr;
+    if (!scratch)
+        scratch = new QMenu();
 
-    if (!menu->actions().contains(action)) {
-        NM_LOG("could not find added action at end of menu (note: old count is %d, new is %d), not moving it to the right spot or adding separator", n, menu->actions().count());
-        return action;
-    }
+    QAction* action = AbstractNickelMenuController_createAction(_this, scratch, widget, /*close*/false, enabled, /*separator*/false);
+    scratch->removeAction(action);
 
-    if (before != nullptr) {
-        menu->removeAction(action);
-        menu->insertAction(before, action);
-    }
+    action->setProperty("nm_action", true);
 
     if (close) {
-        // we can't use the signal which createAction can create, as it gets lost when moving the item
+        // we can't use the signal which createAction can create, as it's for the wrong menu
         QWidget::connect(action, &QAction::triggered, [=](bool){ menu->hide(); });
     }
 
+    QAction *sep = nullptr;
     if (separator) {
         // if it's the main menu, we generally want to use a custom separator
-        QAction *sep;
         if (loc == NM_MENU_LOCATION(main) && LightMenuSeparator_LightMenuSeparator && BoldMenuSeparator_BoldMenuSeparator) {
             sep = reinterpret_cast<QAction*>(calloc(1, 32)); // it's actually 8 as of 14622, but better to be safe
             (last_in_group
                 ? BoldMenuSeparator_BoldMenuSeparator
                 : LightMenuSeparator_LightMenuSeparator
             )(sep, reinterpret_cast<QWidget*>(_this));
-            menu->insertAction(before, sep);
         } else {
-            sep = menu->insertSeparator(before);
+            sep = new QAction(menu); // same as QMenu::insertSeparator
+            sep->setSeparator(true);
         }
         sep->setProperty("nm_action", true);
     }
+    if (sep_out)
+        *sep_out = sep;
 
     return action;
 }
@@ -39,6 +39,12 @@ typedef struct {
     nm_menu_action_t *action;
 } nm_menu_item_t;
 
+// nm_menu_prewarm schedules the config and generators to be updated (and the
+// menus which NickelMenu owns to be rebuilt) once the event loop is idle, so
+// opening a menu afterwards doesn't need to wait for it. It must be called from
+// the GUI thread.
+void nm_menu_prewarm();
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,228 @@
+#define _GNU_SOURCE // open_memstream
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "stall.h"
+#include "stats.h"
+#include "trace.h"
+#include "util.h"
+
+// NM_STALL_DEPTH is the maximum number of nested sections which are checked.
+#ifndef NM_STALL_DEPTH
+#define NM_STALL_DEPTH 8
+#endif
+
+// NM_STALL_HISTORY is the number of stalls which are kept.
+#ifndef NM_STALL_HISTORY
+#define NM_STALL_HISTORY 32
+#endif
+
+// nm_stall_frame_t is a running section. The seq is odd while it is being
+// written, so the watchdog can skip it.
+typedef struct {
+    uint32_t           seq;
+    nm_stall_section_t sec;
+    uint64_t           start;
+    bool               child; // if a nested section was recorded (only used by the UI thread)
+    char               label[48];
+    char               name[32];
+} nm_stall_frame_t;
+
+typedef struct {
+    nm_stall_section_t sec;
+    uint64_t           end;
+    uint64_t           dur_ms;
+    char               label[48];
+    char               name[32];
+} nm_stall_record_t;
+
+static const char *nm_stall_section_names[] = {
+    #define X(name) \
+    [NM_STALL_SECTION(name)] = #name,
+    NM_STALL_SECTIONS
+    #undef X
+};
+
+static unsigned          nm_stall_threshold_ms = 0;
+static nm_stall_frame_t  nm_stall_stack[NM_STALL_DEPTH];
+static int               nm_stall_depth = 0;
+static uint32_t          nm_stall_reported[NM_STALL_DEPTH]; // the seq of the frame last reported by the watchdog (watchdog only)
+static nm_stall_record_t nm_stall_history[NM_STALL_HISTORY];
+static size_t            nm_stall_history_n = 0;
+static pthread_once_t    nm_stall_once = PTHREAD_ONCE_INIT;
+
+// nm_stall_copy copies a string into a fixed-size buffer, truncating it if
+// needed.
+static void nm_stall_copy(char *buf, size_t sz, const char *str) {
+    if (str)
+        snprintf(buf, sz, "%s", str);
+    else
+        buf[0] = '\0';
+}
+
+// nm_stall_desc describes a section (e.g. action cmd_spawn 'Label').
+static void nm_stall_desc(char *buf, size_t sz, nm_stall_section_t sec, const char *label, const char *name) {
+    snprintf(buf, sz, "%s%s%s%s%s%s",
+        nm_stall_section_names[sec],
+        *name ? " " : "", name,
+        *label ? " '" : "", label, *label ? "'" : "");
+}
+
+static void nm_stall_sleep_ms(unsigned ms) {
+    struct timespec ts = {ms / 1000, (long)(ms % 1000) * 1000000};
+    while (nanosleep(&ts, &ts) == -1);
+}
+
+static void *nm_stall_watchdog(void *arg) {
+    (void) arg;
+    for (;;) {
+        unsigned thr = __atomic_load_n(&nm_stall_threshold_ms, __ATOMIC_RELAXED);
+        nm_stall_sleep_ms(!thr ? 1000 : thr/2 < 50 ? 50 : thr/2);
+        if (!thr)
+            continue;
+
+        // report the innermost section which has been running for too long
+        int depth = __atomic_load_n(&nm_stall_depth, __ATOMIC_ACQUIRE);
+        uint64_t now = nm_trace_now();
+        for (int i = (depth < NM_STALL_DEPTH ? depth : NM_STALL_DEPTH) - 1; i >= 0; i--) {
+            nm_stall_frame_t *f = &nm_stall_stack[i];
+            nm_stall_frame_t c;
+
+            uint32_t seq = __atomic_load_n(&f->seq, __ATOMIC_ACQUIRE);
+            if (seq & 1)
+                break;
+            c.sec   = f->sec;
+            c.start = f->start;
+            memcpy(c.label, f->label, sizeof(c.label));
+            memcpy(c.name, f->name, sizeof(c.name));
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&f->seq, __ATOMIC_RELAXED) != seq)
+                break; // it was replaced while copying it
+
+            if (now < c.start || (now - c.start) / 1000 < thr)
+                continue;
+            if (nm_stall_reported[i] != seq) {
+                nm_stall_reported[i] = seq;
+                c.label[sizeof(c.label) - 1] = c.name[sizeof(c.name) - 1] = '\0';
+
+                char desc[128];
+                nm_stall_desc(desc, sizeof(desc), c.sec, c.label, c.name);
+                NM_LOG("stall: %s is still blocking the UI thread after %llu ms", desc, (unsigned long long)((now - c.start) / 1000));
+            }
+            break;
+        }
+    }
+    return NULL;
+}
+
+static void nm_stall_start() {
+    pthread_t thread;
+    pthread_attr_t attr;
+    if (pthread_attr_init(&attr)) {
+        NM_LOG("stall: could not start watchdog thread");
+        return;
+    }
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_attr_setstacksize(&attr, 64 * 1024);
+    if (pthread_create(&thread, &attr, nm_stall_watchdog, NULL))
+        NM_LOG("stall: could not start watchdog thread");
+    pthread_attr_destroy(&attr);
+}
+
+void nm_stall_set_threshold(unsigned ms) {
+    if (__atomic_exchange_n(&nm_stall_threshold_ms, ms, __ATOMIC_RELAXED) != ms) {
+        if (ms)
+            NM_LOG("stall: reporting sections which block the UI thread for %u ms or more", ms);
+        else
+            NM_LOG("stall: disabled");
+    }
+}
+
+bool nm_stall_enter(nm_stall_section_t sec, const char *label, const char *name) {
+    if (!__atomic_load_n(&nm_stall_threshold_ms, __ATOMIC_RELAXED))
+        return false;
+    if (nm_stall_depth >= NM_STALL_DEPTH)
+        return false;
+
+    pthread_once(&nm_stall_once, nm_stall_start);
+
+    nm_stall_frame_t *f = &nm_stall_stack[nm_stall_depth];
+    __atomic_store_n(&f->seq, f->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    f->sec   = sec;
+    f->start = nm_trace_now();
+    f->child = false;
+    nm_stall_copy(f->label, sizeof(f->label), label);
+    nm_stall_copy(f->name, sizeof(f->name), name);
+    __atomic_store_n(&f->seq, f->seq + 1, __ATOMIC_RELEASE);
+
+    __atomic_store_n(&nm_stall_depth, nm_stall_depth + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+void nm_stall_exit() {
+    if (nm_stall_depth <= 0)
+        return;
+
+    nm_stall_frame_t *f = &nm_stall_stack[nm_stall_depth - 1];
+    uint64_t end = nm_trace_now();
+    uint64_t dur_ms = (end - f->start) / 1000;
+    unsigned thr = __atomic_load_n(&nm_stall_threshold_ms, __ATOMIC_RELAXED);
+    bool stalled = thr && dur_ms >= thr && !f->child;
+
+    if (stalled) {
+        nm_stall_record_t *r = &nm_stall_history[nm_stall_history_n++ % NM_STALL_HISTORY];
+        r->sec    = f->sec;
+        r->end    = end;
+        r->dur_ms = dur_ms;
+        memcpy(r->label, f->label, sizeof(r->label));
+        memcpy(r->name, f->name, sizeof(r->name));
+
+        char desc[128];
+        nm_stall_desc(desc, sizeof(desc), r->sec, r->label, r->name);
+        NM_LOG("stall: %s blocked the UI thread for %llu ms", desc, (unsigned long long)(dur_ms));
+        NM_STATS_COUNT(stall, 1);
+    }
+
+    if (nm_stall_depth > 1 && (stalled || f->child))
+        nm_stall_stack[nm_stall_depth - 2].child = true;
+
+    __atomic_store_n(&nm_stall_depth, nm_stall_depth - 1, __ATOMIC_RELEASE);
+}
+
+char *nm_stall_summary() {
+    char *buf = NULL;
+    size_t buf_sz = 0;
+    FILE *f = open_memstream(&buf, &buf_sz);
+    NM_CHECK(NULL, f, "could not allocate memory: %m");
+
+    unsigned thr = __atomic_load_n(&nm_stall_threshold_ms, __ATOMIC_RELAXED);
+    if (thr)
+        fprintf(f, "Showing sections which blocked the UI thread for %u ms or more.", thr);
+    else
+        fprintf(f, "Stall detection is disabled (set experimental:stall_threshold_ms to enable it).");
+
+    if (!nm_stall_history_n) {
+        fprintf(f, "<br><br>No stalls were detected.");
+    } else {
+        uint64_t now = nm_trace_now();
+        fprintf(f, "<br><br><b>%zu stalls</b>%s", nm_stall_history_n, nm_stall_history_n > NM_STALL_HISTORY ? " (showing the most recent ones)" : "");
+        for (size_t i = nm_stall_history_n; i > 0 && i + NM_STALL_HISTORY > nm_stall_history_n; i--) {
+            nm_stall_record_t *r = &nm_stall_history[(i - 1) % NM_STALL_HISTORY];
+            char desc[128];
+            nm_stall_desc(desc, sizeof(desc), r->sec, r->label, r->name);
+            fprintf(f, "<br>%s: %llu ms, %llu s ago", desc, (unsigned long long)(r->dur_ms), (unsigned long long)((now - r->end) / 1000000));
+        }
+    }
+
+    if (fclose(f)) {
+        free(buf);
+        NM_ERR_RET(NULL, "could not allocate memory");
+    }
+    return buf;
+}
@@ -0,0 +1,71 @@
+#ifndef NM_STALL_H
+#define NM_STALL_H
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Stall detection (UI thread only, except for the watchdog):
+//
+// Sections which run on the UI thread (and block Nickel's input handling and
+// screen updates while they do) are timed, and any which take longer than the
+// threshold (set with the stall_threshold_ms experimental option) are recorded
+// and logged. A watchdog thread also logs sections which are still running
+// after the threshold, so hangs are visible even if they never return. If
+// nested sections both stall, only the innermost one is recorded.
+
+// NM_STALL_SECTIONS are the kinds of sections which are checked.
+#define NM_STALL_SECTIONS \
+    X(item)               \
+    X(action)             \
+    X(config_update)      \
+    X(generator)
+
+#define NM_STALL_SECTION(name) NM_STALL_SECTION_##name
+
+typedef enum {
+    #define X(name) \
+    NM_STALL_SECTION(name),
+    NM_STALL_SECTIONS
+    #undef X
+} nm_stall_section_t;
+
+// nm_stall_set_threshold sets the threshold in milliseconds, or disables stall
+// detection if it is 0.
+void nm_stall_set_threshold(unsigned ms);
+
+// nm_stall_enter starts a section. The label (the menu item, if any) and name
+// (the action or generator, if any) are copied. If stall detection is
+// disabled, false is returned, and nm_stall_exit must not be called.
+bool nm_stall_enter(nm_stall_section_t sec, const char *label, const char *name);
+
+// nm_stall_exit ends the innermost section, and records it if it stalled.
+void nm_stall_exit();
+
+// nm_stall_summary returns a malloc'd human-readable list of the most recent
+// stalls, with lines separated by <br>. On error, NULL is returned and nm_err
+// is set.
+char *nm_stall_summary();
+
+typedef struct {
+    bool active;
+} nm_stall_scope_t;
+
+__attribute__((unused)) static inline void nm_stall_scope_end(nm_stall_scope_t *scope) {
+    if (scope->active)
+        nm_stall_exit();
+}
+
+#define _NM_STALL_CAT(a, b) a##b
+#define _NM_STALL_SCOPE_VAR(n) _NM_STALL_CAT(_nm_stall_scope_, n)
+
+// NM_STALL_SCOPE checks the rest of the current scope.
+#define NM_STALL_SCOPE(name, label, sname) \
+    __attribute__((cleanup(nm_stall_scope_end), unused)) nm_stall_scope_t _NM_STALL_SCOPE_VAR(__COUNTER__) = {nm_stall_enter(NM_STALL_SECTION(name), (label), (sname))}
+
+#ifdef __cplusplus
+}
+#endif
+#endif
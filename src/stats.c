@@ -0,0 +1,214 @@
+#define _GNU_SOURCE // open_memstream
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "action.h"
+#include "stats.h"
+#include "trace.h"
+#include "util.h"
+
+// NM_STATS_BUCKETS are the upper bounds of the histogram buckets in
+// microseconds (there's another one for anything longer).
+#define NM_STATS_BUCKETS \
+    X(100)               \
+    X(300)               \
+    X(1000)              \
+    X(3000)              \
+    X(10000)             \
+    X(30000)             \
+    X(100000)            \
+    X(300000)            \
+    X(1000000)           \
+    X(3000000)
+
+static const uint64_t nm_stats_bucket_max[] = {
+    #define X(us) us,
+    NM_STATS_BUCKETS
+    #undef X
+};
+
+#define NM_STATS_BUCKET_N (sizeof(nm_stats_bucket_max)/sizeof(*nm_stats_bucket_max) + 1)
+
+typedef struct {
+    uint64_t count;
+    uint64_t sum_us;
+    uint64_t max_us;
+    uint64_t buckets[NM_STATS_BUCKET_N];
+} nm_stats_hist_t;
+
+static const char *nm_stats_counter_names[] = {
+    #define X(name) \
+    [NM_STATS_COUNTER(name)] = #name,
+    NM_STATS_COUNTERS
+    #undef X
+};
+
+static const char *nm_stats_section_names[] = {
+    #define X(name) \
+    [NM_TRACE_EVENT(name)] = #name,
+    NM_TRACE_EVENTS
+    #undef X
+};
+
+static const char *nm_stats_action_names[] = {
+    #define X(name) \
+    #name,
+    NM_ACTIONS
+    #undef X
+};
+
+#define NM_STATS_LEN(arr) (sizeof(arr)/sizeof(*(arr)))
+
+bool nm_stats_enabled = false;
+
+static uint64_t        nm_stats_counters[NM_STATS_LEN(nm_stats_counter_names)];
+static nm_stats_hist_t nm_stats_sections[NM_STATS_LEN(nm_stats_section_names)];
+static nm_stats_hist_t nm_stats_actions[NM_STATS_LEN(nm_stats_action_names)];
+
+void nm_stats_set_enabled(bool enabled) {
+    if (__atomic_exchange_n(&nm_stats_enabled, enabled, __ATOMIC_RELAXED) != enabled)
+        NM_LOG("stats: %s", enabled ? "enabled" : "disabled");
+}
+
+void nm_stats_count_(nm_stats_counter_t counter, uint64_t n) {
+    if ((size_t)(counter) < NM_STATS_LEN(nm_stats_counters))
+        __atomic_fetch_add(&nm_stats_counters[counter], n, __ATOMIC_RELAXED);
+}
+
+static void nm_stats_hist_add(nm_stats_hist_t *h, uint64_t us) {
+    size_t b = 0;
+    while (b < NM_STATS_BUCKET_N - 1 && us > nm_stats_bucket_max[b])
+        b++;
+    __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum_us, us, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->buckets[b], 1, __ATOMIC_RELAXED);
+    for (uint64_t max = __atomic_load_n(&h->max_us, __ATOMIC_RELAXED); us > max;)
+        if (__atomic_compare_exchange_n(&h->max_us, &max, us, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            break;
+}
+
+void nm_stats_section_(nm_trace_event_t ev, uint64_t us) {
+    if ((size_t)(ev) < NM_STATS_LEN(nm_stats_sections))
+        nm_stats_hist_add(&nm_stats_sections[ev], us);
+}
+
+void nm_stats_action_(const char *name, uint64_t us) {
+    if (name)
+        for (size_t i = 0; i < NM_STATS_LEN(nm_stats_action_names); i++)
+            if (!strcmp(name, nm_stats_action_names[i])) {
+                nm_stats_hist_add(&nm_stats_actions[i], us);
+                return;
+            }
+}
+
+// nm_stats_hist_get copies a histogram (the fields may be slightly out of sync
+// with each other if it's being updated concurrently).
+static nm_stats_hist_t nm_stats_hist_get(nm_stats_hist_t *h) {
+    nm_stats_hist_t c;
+    c.count  = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+    c.sum_us = __atomic_load_n(&h->sum_us, __ATOMIC_RELAXED);
+    c.max_us = __atomic_load_n(&h->max_us, __ATOMIC_RELAXED);
+    for (size_t b = 0; b < NM_STATS_BUCKET_N; b++)
+        c.buckets[b] = __atomic_load_n(&h->buckets[b], __ATOMIC_RELAXED);
+    return c;
+}
+
+// nm_stats_hist_p90 returns the upper bound of the bucket containing the 90th
+// percentile, or 0 if it's in the last one.
+static uint64_t nm_stats_hist_p90(nm_stats_hist_t *h) {
+    uint64_t n = 0;
+    for (size_t b = 0; b < NM_STATS_BUCKET_N - 1; b++)
+        if ((n += h->buckets[b]) * 10 >= h->count * 9)
+            return nm_stats_bucket_max[b];
+    return 0;
+}
+
+static void nm_stats_summary_hist(FILE *f, const char *name, nm_stats_hist_t *h) {
+    nm_stats_hist_t c = nm_stats_hist_get(h);
+    if (!c.count)
+        return;
+    uint64_t p90 = nm_stats_hist_p90(&c);
+    fprintf(f, "<br>%s: %llux, avg %.1f ms, p90 %s%.1f ms, max %.1f ms", name,
+        (unsigned long long)(c.count),
+        (double)(c.sum_us) / c.count / 1000,
+        p90 ? "< " : "> ", (p90 ? p90 : nm_stats_bucket_max[NM_STATS_BUCKET_N - 2]) / 1000.0,
+        c.max_us / 1000.0);
+}
+
+char *nm_stats_summary() {
+    char *buf = NULL;
+    size_t buf_sz = 0;
+    FILE *f = open_memstream(&buf, &buf_sz);
+    NM_CHECK(NULL, f, "could not allocate memory: %m");
+
+    fprintf(f, "Stats are %s.", __atomic_load_n(&nm_stats_enabled, __ATOMIC_RELAXED) ? "enabled" : "disabled (set experimental:stats:1 to enable them)");
+
+    fprintf(f, "<br><br><b>Counters</b>");
+    for (size_t i = 0; i < NM_STATS_LEN(nm_stats_counters); i++)
+        if (__atomic_load_n(&nm_stats_counters[i], __ATOMIC_RELAXED))
+            fprintf(f, "<br>%s: %llu", nm_stats_counter_names[i], (unsigned long long)(__atomic_load_n(&nm_stats_counters[i], __ATOMIC_RELAXED)));
+
+    fprintf(f, "<br><br><b>Sections</b>");
+    for (size_t i = 0; i < NM_STATS_LEN(nm_stats_sections); i++)
+        nm_stats_summary_hist(f, nm_stats_section_names[i], &nm_stats_sections[i]);
+
+    fprintf(f, "<br><br><b>Actions</b>");
+    for (size_t i = 0; i < NM_STATS_LEN(nm_stats_actions); i++)
+        nm_stats_summary_hist(f, nm_stats_action_names[i], &nm_stats_actions[i]);
+
+    if (fclose(f)) {
+        free(buf);
+        NM_ERR_RET(NULL, "could not allocate memory");
+    }
+    return buf;
+}
+
+static void nm_stats_dump_hist(FILE *f, const char *name, nm_stats_hist_t *h, bool first) {
+    nm_stats_hist_t c = nm_stats_hist_get(h);
+    fprintf(f, "%s\n    \"%s\": {\"count\": %llu, \"sum_us\": %llu, \"max_us\": %llu, \"buckets\": [", first ? "" : ",", name,
+        (unsigned long long)(c.count),
+        (unsigned long long)(c.sum_us),
+        (unsigned long long)(c.max_us));
+    for (size_t b = 0; b < NM_STATS_BUCKET_N; b++)
+        fprintf(f, "%s%llu", b ? ", " : "", (unsigned long long)(c.buckets[b]));
+    fprintf(f, "]}");
+}
+
+bool nm_stats_dump(const char *path) {
+    char *buf = NULL;
+    size_t buf_sz = 0;
+    FILE *f = open_memstream(&buf, &buf_sz);
+    NM_CHECK(false, f, "could not allocate memory: %m");
+
+    fprintf(f, "{\n  \"enabled\": %s,\n  \"bucket_max_us\": [", __atomic_load_n(&nm_stats_enabled, __ATOMIC_RELAXED) ? "true" : "false");
+    for (size_t b = 0; b < NM_STATS_BUCKET_N - 1; b++)
+        fprintf(f, "%s%llu", b ? ", " : "", (unsigned long long)(nm_stats_bucket_max[b]));
+    fprintf(f, "],\n");
+
+    fprintf(f, "  \"counters\": {");
+    for (size_t i = 0; i < NM_STATS_LEN(nm_stats_counters); i++)
+        fprintf(f, "%s\n    \"%s\": %llu", i ? "," : "", nm_stats_counter_names[i], (unsigned long long)(__atomic_load_n(&nm_stats_counters[i], __ATOMIC_RELAXED)));
+    fprintf(f, "\n  },\n");
+
+    fprintf(f, "  \"sections\": {");
+    for (size_t i = 0; i < NM_STATS_LEN(nm_stats_sections); i++)
+        nm_stats_dump_hist(f, nm_stats_section_names[i], &nm_stats_sections[i], !i);
+    fprintf(f, "\n  },\n");
+
+    fprintf(f, "  \"actions\": {");
+    for (size_t i = 0; i < NM_STATS_LEN(nm_stats_actions); i++)
+        nm_stats_dump_hist(f, nm_stats_action_names[i], &nm_stats_actions[i], !i);
+    fprintf(f, "\n  }\n}\n");
+
+    if (fclose(f)) {
+        free(buf);
+        NM_ERR_RET(false, "could not allocate memory");
+    }
+
+    bool ok = nm_file_replace(path, buf, buf_sz);
+    free(buf);
+    return ok;
+}
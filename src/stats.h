@@ -0,0 +1,80 @@
+#ifndef NM_STATS_H
+#define NM_STATS_H
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "trace.h"
+
+// Stats (thread-safe):
+//
+// The stats are counters and fixed-bucket latency histograms for the traced
+// sections and each action. They are only updated while enabled (with the
+// stats experimental option), and cost a single relaxed load otherwise.
+
+// NM_STATS_COUNTERS are the counters.
+#define NM_STATS_COUNTERS \
+    X(config_error)       \
+    X(config_changed)     \
+    X(menu_item_added)    \
+    X(menu_item_updated)  \
+    X(menu_item_removed)  \
+    X(menu_item_moved)    \
+    X(action_run)         \
+    X(action_error)       \
+    X(stall)
+
+#define NM_STATS_COUNTER(name) NM_STATS_COUNTER_##name
+
+typedef enum {
+    #define X(name) \
+    NM_STATS_COUNTER(name),
+    NM_STATS_COUNTERS
+    #undef X
+} nm_stats_counter_t;
+
+extern bool nm_stats_enabled;
+
+// nm_stats_set_enabled enables or disables updating the stats. The existing
+// values are kept.
+void nm_stats_set_enabled(bool enabled);
+
+void nm_stats_count_(nm_stats_counter_t counter, uint64_t n);
+void nm_stats_section_(nm_trace_event_t ev, uint64_t us);
+void nm_stats_action_(const char *name, uint64_t us);
+
+// NM_STATS_COUNT adds n to a counter.
+#define NM_STATS_COUNT(name, n) do {                           \
+    if (__atomic_load_n(&nm_stats_enabled, __ATOMIC_RELAXED)) \
+        nm_stats_count_(NM_STATS_COUNTER(name), (n));          \
+} while (0)
+
+// nm_stats_section records the duration of a traced section (this is done by
+// nm_trace_add).
+__attribute__((unused)) static inline void nm_stats_section(nm_trace_event_t ev, uint64_t us) {
+    if (__atomic_load_n(&nm_stats_enabled, __ATOMIC_RELAXED))
+        nm_stats_section_(ev, us);
+}
+
+// nm_stats_action records the duration of an action (by its name from
+// nm_action_name).
+__attribute__((unused)) static inline void nm_stats_action(const char *name, uint64_t us) {
+    if (__atomic_load_n(&nm_stats_enabled, __ATOMIC_RELAXED))
+        nm_stats_action_(name, us);
+}
+
+// nm_stats_summary returns a malloc'd human-readable summary of the non-zero
+// stats, with lines separated by <br>. On error, NULL is returned and nm_err is
+// set.
+char *nm_stats_summary();
+
+// nm_stats_dump writes the stats to the specified file as JSON, replacing it
+// atomically. On error, false is returned and nm_err is set.
+bool nm_stats_dump(const char *path);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,140 @@
+#define _GNU_SOURCE // syscall, open_memstream
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "stats.h"
+#include "trace.h"
+#include "util.h"
+
+_Static_assert((NM_TRACE_SIZE & (NM_TRACE_SIZE - 1)) == 0, "NM_TRACE_SIZE must be a power of two");
+
+// nm_trace_slot_t is an event in the ring. The seq is pos*2+1 while it is being
+// written, and pos*2+2 once it's done, so torn or overwritten events can be
+// skipped when dumping it.
+typedef struct {
+    uint64_t seq;
+    uint64_t ts;
+    uint32_t dur;
+    uint16_t ev;
+    int32_t  tid;
+    char     arg[40];
+} nm_trace_slot_t;
+
+static nm_trace_slot_t nm_trace_ring[NM_TRACE_SIZE];
+static uint64_t        nm_trace_head = 0; // next position to write
+
+static const char *nm_trace_event_names[] = {
+    #define X(name) \
+    [NM_TRACE_EVENT(name)] = #name,
+    NM_TRACE_EVENTS
+    #undef X
+};
+
+static __thread int32_t nm_trace_tid = 0;
+
+uint64_t nm_trace_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)(ts.tv_sec) * 1000000 + (uint64_t)(ts.tv_nsec) / 1000;
+}
+
+void nm_trace_add(nm_trace_event_t ev, uint64_t start, const char *arg) {
+    uint64_t end = nm_trace_now();
+    if (!nm_trace_tid)
+        nm_trace_tid = (int32_t)(syscall(SYS_gettid));
+
+    uint64_t pos = __atomic_fetch_add(&nm_trace_head, 1, __ATOMIC_RELAXED);
+    nm_trace_slot_t *slot = &nm_trace_ring[pos & (NM_TRACE_SIZE - 1)];
+
+    __atomic_store_n(&slot->seq, pos*2 + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    slot->ts  = start;
+    slot->dur = end - start > UINT32_MAX ? UINT32_MAX : (uint32_t)(end - start);
+    slot->ev  = (uint16_t)(ev);
+    slot->tid = nm_trace_tid;
+    if (arg) {
+        size_t n = strlen(arg);
+        if (n >= sizeof(slot->arg)) {
+            // don't cut off a UTF-8 sequence
+            n = sizeof(slot->arg) - 1;
+            while (n && ((unsigned char)(arg[n]) & 0xC0) == 0x80)
+                n--;
+        }
+        memcpy(slot->arg, arg, n);
+        slot->arg[n] = '\0';
+    } else {
+        slot->arg[0] = '\0';
+    }
+
+    __atomic_store_n(&slot->seq, pos*2 + 2, __ATOMIC_RELEASE);
+
+    nm_stats_section(ev, end - start);
+}
+
+// nm_trace_json_str writes a JSON string.
+static void nm_trace_json_str(FILE *f, const char *s) {
+    fputc('"', f);
+    for (const unsigned char *c = (const unsigned char*)(s); *c; c++) {
+        if (*c == '"' || *c == '\\')
+            fprintf(f, "\\%c", *c);
+        else if (*c < 0x20)
+            fprintf(f, "\\u%04x", *c);
+        else
+            fputc(*c, f);
+    }
+    fputc('"', f);
+}
+
+int nm_trace_dump(const char *path) {
+    char *buf = NULL;
+    size_t buf_sz = 0;
+    FILE *f = open_memstream(&buf, &buf_sz);
+    NM_CHECK(-1, f, "could not allocate memory: %m");
+
+    int pid = getpid(), n = 0;
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"nickel\"}}", pid);
+
+    uint64_t head = __atomic_load_n(&nm_trace_head, __ATOMIC_ACQUIRE);
+    for (uint64_t pos = head > NM_TRACE_SIZE ? head - NM_TRACE_SIZE : 0; pos < head; pos++) {
+        nm_trace_slot_t *slot = &nm_trace_ring[pos & (NM_TRACE_SIZE - 1)];
+        nm_trace_slot_t ev;
+
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos*2 + 2)
+            continue; // still being written, or already overwritten
+        memcpy(&ev, slot, sizeof(ev));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != pos*2 + 2)
+            continue; // overwritten while copying it
+        if (ev.ev >= sizeof(nm_trace_event_names)/sizeof(*nm_trace_event_names))
+            continue;
+
+        fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"nm\",\"ph\":\"X\",\"ts\":%llu,\"dur\":%u,\"pid\":%d,\"tid\":%d",
+            nm_trace_event_names[ev.ev], (unsigned long long)(ev.ts), ev.dur, pid, ev.tid);
+        if (ev.arg[0]) {
+            ev.arg[sizeof(ev.arg) - 1] = '\0';
+            fprintf(f, ",\"args\":{\"arg\":");
+            nm_trace_json_str(f, ev.arg);
+            fputc('}', f);
+        }
+        fputc('}', f);
+        n++;
+    }
+
+    fprintf(f, "\n]}\n");
+
+    if (fclose(f)) {
+        free(buf);
+        NM_ERR_RET(-1, "could not allocate memory");
+    }
+
+    bool ok = nm_file_replace(path, buf, buf_sz);
+    free(buf);
+    return ok ? n : -1;
+}
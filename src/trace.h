@@ -0,0 +1,83 @@
+#ifndef NM_TRACE_H
+#define NM_TRACE_H
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+// Tracing (thread-safe):
+//
+// The trace is a fixed-size in-memory ring of the most recent timed sections,
+// which can be written in the Chrome trace event format (for chrome://tracing,
+// Perfetto, or speedscope) by the dbg_trace action.
+
+// NM_TRACE_SIZE is the number of events kept (it must be a power of two).
+#ifndef NM_TRACE_SIZE
+#define NM_TRACE_SIZE 1024
+#endif
+
+// NM_TRACE_EVENTS are the traced sections.
+#define NM_TRACE_EVENTS     \
+    X(hook_menu)            \
+    X(hook_main_nav)        \
+    X(hook_selection)       \
+    X(hook_search)          \
+    X(config_update)        \
+    X(config_files_update)  \
+    X(config_parse)         \
+    X(config_generate)      \
+    X(config_get_menu)      \
+    X(generator)            \
+    X(menu_inject)          \
+    X(menu_inject_items)    \
+    X(menu_main_nav)        \
+    X(menu_prewarm)         \
+    X(item)                 \
+    X(action)
+
+#define NM_TRACE_EVENT(name) NM_TRACE_EVENT_##name
+
+typedef enum {
+    #define X(name) \
+    NM_TRACE_EVENT(name),
+    NM_TRACE_EVENTS
+    #undef X
+} nm_trace_event_t;
+
+// nm_trace_now returns the current CLOCK_MONOTONIC time in microseconds.
+uint64_t nm_trace_now();
+
+// nm_trace_add records a section which started at the specified time (from
+// nm_trace_now) and ends now, and adds it to the stats. The arg (e.g. an item
+// label or an action name) is optional, and is copied (truncated if it's too
+// long).
+void nm_trace_add(nm_trace_event_t ev, uint64_t start, const char *arg);
+
+// nm_trace_dump writes the events currently in the trace to the specified file
+// as Chrome trace event JSON, replacing it atomically. On success, the number of
+// events written is returned. Otherwise, -1 is returned and nm_err is set.
+int nm_trace_dump(const char *path);
+
+typedef struct {
+    nm_trace_event_t ev;
+    const char      *arg;
+    uint64_t         start;
+} nm_trace_scope_t;
+
+__attribute__((unused)) static inline void nm_trace_scope_end(nm_trace_scope_t *scope) {
+    nm_trace_add(scope->ev, scope->start, scope->arg);
+}
+
+#define _NM_TRACE_CAT(a, b) a##b
+#define _NM_TRACE_SCOPE_VAR(n) _NM_TRACE_CAT(_nm_trace_scope_, n)
+
+// NM_TRACE_SCOPE traces the rest of the current scope. The arg must stay valid
+// until the end of it.
+#define NM_TRACE_SCOPE(name, arg) \
+    __attribute__((cleanup(nm_trace_scope_end), unused)) nm_trace_scope_t _NM_TRACE_SCOPE_VAR(__COUNTER__) = {NM_TRACE_EVENT(name), (arg), nm_trace_now()}
+
+#ifdef __cplusplus
+}
+#endif
+#endif
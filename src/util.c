@@ -1,7 +1,17 @@
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <semaphore.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "util.h"
 
 static __thread bool nm_err_state                       = false;
 static __thread char nm_err_buf[2048]                   = {0};
@@ -38,3 +48,191 @@ bool nm_err_set(const char *fmt, ...) {
     }
     return nm_err_state;
 }
+
+bool nm_file_replace(const char *path, const char *data, size_t len) {
+    NM_CHECK(false, path && *path == '/', "path must be absolute");
+
+    char tmp[PATH_MAX];
+    NM_CHECK(false, snprintf(tmp, sizeof(tmp), "%s.tmp", path) < (int)(sizeof(tmp)), "path too long");
+
+    FILE *f = fopen(tmp, "w");
+    if (!f)
+        NM_ERR_RET(false, "could not open '%s': %m", tmp);
+
+    bool ok = fwrite(data, 1, len, f) == len;
+    if (fclose(f) || !ok) {
+        int e = errno;
+        unlink(tmp);
+        errno = e;
+        NM_ERR_RET(false, "could not write '%s': %m", tmp);
+    }
+
+    if (rename(tmp, path)) {
+        int e = errno;
+        unlink(tmp);
+        errno = e;
+        NM_ERR_RET(false, "could not rename '%s' to '%s': %m", tmp, path);
+    }
+
+    nm_err_set(NULL);
+    return true;
+}
+
+// NM_LOG_RING_SIZE is the number of messages which can be queued for the logger
+// thread (it must be a power of two), and NM_LOG_MSG_MAX is the maximum length
+// of each one (longer ones are truncated).
+#ifndef NM_LOG_RING_SIZE
+#define NM_LOG_RING_SIZE 256
+#endif
+#ifndef NM_LOG_MSG_MAX
+#define NM_LOG_MSG_MAX 512
+#endif
+
+_Static_assert((NM_LOG_RING_SIZE & (NM_LOG_RING_SIZE - 1)) == 0, "NM_LOG_RING_SIZE must be a power of two");
+
+int nm_log_level = NM_LOG_LEVEL(info);
+
+static const char *nm_log_level_names[] = {
+    #define X(name) \
+    [NM_LOG_LEVEL(name)] = #name,
+    NM_LOG_LEVELS
+    #undef X
+};
+
+void nm_log_set_level(const char *name) {
+    int level = NM_LOG_LEVEL(info);
+    if (name) {
+        for (level = 0; level < (int)(sizeof(nm_log_level_names)/sizeof(*nm_log_level_names)); level++)
+            if (!strcasecmp(name, nm_log_level_names[level]))
+                break;
+        if (level == (int)(sizeof(nm_log_level_names)/sizeof(*nm_log_level_names))) {
+            NM_LOG_ERROR("log: unknown log level '%s', ignoring", name);
+            return;
+        }
+        if (level > NM_LOG_LEVEL_MAX)
+            NM_LOG("log: log level %s was not compiled in, messages above %s will not be logged", name, nm_log_level_names[NM_LOG_LEVEL_MAX]);
+    }
+    if (__atomic_exchange_n(&nm_log_level, level, __ATOMIC_RELAXED) != level)
+        NM_LOG("log: log level set to %s", nm_log_level_names[level]);
+}
+
+// nm_log_slot_t is a queued message. It is a bounded MPSC queue where seq is
+// the position the slot is ready to be written at (if equal to the position),
+// or read at (if one past it).
+typedef struct {
+    size_t seq;
+    char   msg[NM_LOG_MSG_MAX];
+} nm_log_slot_t;
+
+static nm_log_slot_t  nm_log_ring[NM_LOG_RING_SIZE];
+static size_t         nm_log_head     = 0;     // next position to write (producers)
+static size_t         nm_log_tail     = 0;     // next position to read (logger thread)
+static int            nm_log_sleeping = 0;     // whether the logger thread is (about to be) waiting on nm_log_sem
+static sem_t          nm_log_sem;
+static bool           nm_log_started  = false; // if false, messages are written directly
+static pthread_once_t nm_log_once     = PTHREAD_ONCE_INIT;
+
+// nm_log_drain writes all messages which are ready, and returns true if any
+// were written.
+static bool nm_log_drain() {
+    bool any = false;
+    for (;;) {
+        nm_log_slot_t *slot = &nm_log_ring[nm_log_tail & (NM_LOG_RING_SIZE - 1)];
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != nm_log_tail + 1)
+            return any;
+        nh_log("%s", slot->msg);
+        __atomic_store_n(&slot->seq, nm_log_tail + NM_LOG_RING_SIZE, __ATOMIC_RELEASE);
+        __atomic_store_n(&nm_log_tail, nm_log_tail + 1, __ATOMIC_RELEASE);
+        any = true;
+    }
+}
+
+static void *nm_log_thread(void *arg) {
+    (void) arg;
+    for (;;) {
+        if (nm_log_drain())
+            continue;
+        __atomic_store_n(&nm_log_sleeping, 1, __ATOMIC_SEQ_CST);
+        if (nm_log_drain()) { // a message could have been queued before it was set
+            __atomic_store_n(&nm_log_sleeping, 0, __ATOMIC_SEQ_CST);
+            continue;
+        }
+        while (sem_wait(&nm_log_sem) == -1);
+    }
+    return NULL;
+}
+
+// nm_log_flush waits (for up to 250ms) for the logger thread to write the
+// messages which are still queued when the library is unloaded or the process
+// exits normally. Any messages logged after this are written directly.
+__attribute__((destructor)) static void nm_log_flush() {
+    if (!__atomic_exchange_n(&nm_log_started, false, __ATOMIC_SEQ_CST))
+        return;
+    for (int i = 0; i < 50 && __atomic_load_n(&nm_log_tail, __ATOMIC_ACQUIRE) != __atomic_load_n(&nm_log_head, __ATOMIC_ACQUIRE); i++) {
+        if (__atomic_exchange_n(&nm_log_sleeping, 0, __ATOMIC_SEQ_CST))
+            sem_post(&nm_log_sem);
+        nanosleep(&(struct timespec){0, 5 * 1000 * 1000}, NULL);
+    }
+}
+
+static void nm_log_start() {
+    for (size_t i = 0; i < NM_LOG_RING_SIZE; i++)
+        nm_log_ring[i].seq = i;
+
+    pthread_t thread;
+    pthread_attr_t attr;
+    if (sem_init(&nm_log_sem, 0, 0) || pthread_attr_init(&attr)) {
+        nh_log("log: could not initialize logger thread, writing messages directly: %m");
+        return;
+    }
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_attr_setstacksize(&attr, 64 * 1024);
+    if (pthread_create(&thread, &attr, nm_log_thread, NULL)) {
+        nh_log("log: could not start logger thread, writing messages directly: %m");
+        pthread_attr_destroy(&attr);
+        return;
+    }
+    pthread_attr_destroy(&attr);
+    __atomic_store_n(&nm_log_started, true, __ATOMIC_SEQ_CST);
+}
+
+void nm_log(nm_log_level_t level, const char *fmt, ...) {
+    va_list a;
+    pthread_once(&nm_log_once, nm_log_start);
+
+    // reserve a slot (unless it's full or it's an error)
+    nm_log_slot_t *slot = NULL;
+    size_t pos = __atomic_load_n(&nm_log_head, __ATOMIC_RELAXED);
+    while (level != NM_LOG_LEVEL(error) && __atomic_load_n(&nm_log_started, __ATOMIC_RELAXED)) {
+        nm_log_slot_t *s = &nm_log_ring[pos & (NM_LOG_RING_SIZE - 1)];
+        intptr_t dif = (intptr_t)(__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE)) - (intptr_t)(pos);
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&nm_log_head, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                slot = s;
+                break;
+            }
+        } else if (dif < 0) {
+            break; // full
+        } else {
+            pos = __atomic_load_n(&nm_log_head, __ATOMIC_RELAXED);
+        }
+    }
+
+    if (!slot) {
+        char buf[NM_LOG_MSG_MAX];
+        va_start(a, fmt);
+        vsnprintf(buf, sizeof(buf), fmt, a);
+        va_end(a);
+        nh_log("%s", buf);
+        return;
+    }
+
+    va_start(a, fmt);
+    if (vsnprintf(slot->msg, sizeof(slot->msg), fmt, a) >= (int)(sizeof(slot->msg)))
+        memcpy(&slot->msg[sizeof(slot->msg) - 4], "...", 4);
+    va_end(a);
+
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+    if (__atomic_exchange_n(&nm_log_sleeping, 0, __ATOMIC_SEQ_CST))
+        sem_post(&nm_log_sem);
+}
@@ -22,8 +22,76 @@ __attribute__((unused)) static inline char *strtrim(char *s) {
     return a;
 }
 
+// nm_file_replace atomically replaces the file at the specified absolute path
+// with the data (by writing it to a temporary file next to it first). On error,
+// false is returned and nm_err is set.
+bool nm_file_replace(const char *path, const char *data, size_t len);
+
+// Logging (thread-safe):
+
+// NM_LOG_LEVELS are the log levels, from the most to the least important.
+#define NM_LOG_LEVELS \
+    X(error)          \
+    X(info)           \
+    X(debug)
+
+#define NM_LOG_LEVEL(name) NM_LOG_LEVEL_##name
+
+typedef enum {
+    #define X(name) \
+    NM_LOG_LEVEL(name),
+    NM_LOG_LEVELS
+    #undef X
+} nm_log_level_t;
+
+// NM_LOG_LEVEL_MAX is the least important level which is compiled in. Messages
+// for less important levels are still type-checked, but are eliminated at
+// compile-time. The default only includes debug messages if built with
+// NM_VERBOSE.
+#ifndef NM_LOG_LEVEL_MAX
+#ifdef NM_VERBOSE
+#define NM_LOG_LEVEL_MAX NM_LOG_LEVEL(debug)
+#else
+#define NM_LOG_LEVEL_MAX NM_LOG_LEVEL(info)
+#endif
+#endif
+
+// nm_log_level is the least important level which is logged at runtime. Use
+// nm_log_set_level to change it.
+extern int nm_log_level;
+
+// nm_log_set_level sets the runtime log level by name (see NM_LOG_LEVELS), or
+// resets it to the default (info) if name is NULL. Unknown names are logged and
+// ignored.
+void nm_log_set_level(const char *name);
+
+// nm_log formats a message on the calling thread and queues it to be written by
+// the logger thread, so it doesn't block on syslog. Errors are written directly
+// (so they aren't lost if it crashes), as are messages which don't fit in the
+// queue.
+void nm_log(nm_log_level_t level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+// nm_log_enabled checks if the level is enabled at runtime.
+__attribute__((unused)) static inline bool nm_log_enabled(nm_log_level_t level) {
+    return (int)(level) <= __atomic_load_n(&nm_log_level, __ATOMIC_RELAXED);
+}
+
+// NM_LOG_AT writes a log message with the specified level. The arguments are
+// only evaluated if the level is enabled.
+#define NM_LOG_AT(level, fmt, ...) do {                                     \
+    if ((level) <= NM_LOG_LEVEL_MAX && nm_log_enabled(level))               \
+        nm_log((level), fmt " (%s:%d)", ##__VA_ARGS__, __FILE__, __LINE__); \
+} while (0)
+
 // NM_LOG writes a log message.
-#define NM_LOG(fmt, ...) nh_log(fmt " (%s:%d)", ##__VA_ARGS__, __FILE__, __LINE__)
+#define NM_LOG(fmt, ...) NM_LOG_AT(NM_LOG_LEVEL(info), fmt, ##__VA_ARGS__)
+
+// NM_LOG_ERROR writes an error message.
+#define NM_LOG_ERROR(fmt, ...) NM_LOG_AT(NM_LOG_LEVEL(error), fmt, ##__VA_ARGS__)
+
+// NM_LOG_VERBOSE writes a debug message. It is used for things which happen too
+// often to be logged otherwise.
+#define NM_LOG_VERBOSE(fmt, ...) NM_LOG_AT(NM_LOG_LEVEL(debug), fmt, ##__VA_ARGS__)
 
 // Error handling (thread-safe):
 
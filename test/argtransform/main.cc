@@ -0,0 +1,216 @@
+// Compares the parsed argument templates used by _nm_selmenu_argtransform with
+// the original implementation, which used regexes on every call.
+
+#include <QElapsedTimer>
+#include <QList>
+#include <QRegularExpression>
+#include <QString>
+#include <QUrl>
+
+#include <algorithm>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "argtransform.h"
+#include "util.h"
+
+// old_argtransform is the original _nm_selmenu_argtransform.
+static char *old_argtransform(QString const& selection, const char *arg) {
+    QString src = QString::fromUtf8(arg), res;
+    QRegularExpression re = QRegularExpression("\\{([1])\\|([aAfnsSuwx]*)\\|([\"$%]*)\\}");
+
+    for (QStringRef x = src.midRef(0); x.length() > 0;) {
+        QRegularExpressionMatch m = re.match(x.toString());
+
+        if (!m.hasMatch()) {
+            res += x;
+            x = x.mid(x.length());
+            continue;
+        }
+
+        QString tmp;
+
+        for (int k = 0; k < m.capturedLength(1); k++) {
+            switch (m.capturedRef(1).at(k).toLatin1()) {
+            case '1': tmp = selection; break;
+            }
+        }
+
+        for (int k = 0; k < m.capturedLength(2); k++) {
+            switch (m.capturedRef(2).at(k).toLatin1()) {
+            case 'a': tmp = tmp.toLower(); break;
+            case 'A': tmp = tmp.toUpper(); break;
+            case 'f': tmp = tmp.split(QRegularExpression("\\s")).first(); break;
+            case 'n': tmp = tmp.remove(QRegularExpression("[^0-9a-zA-Z]")); break;
+            case 's': tmp = tmp.trimmed(); break;
+            case 'S': tmp = tmp.simplified(); break;
+            case 'u': if (tmp.length() == 0) { nm_err_set("argtransform: empty substitution result for %s", qPrintable(m.capturedRef(0).toString())); return NULL; }; break;
+            case 'w': tmp = tmp.remove(QRegularExpression("\\s")); break;
+            case 'x': tmp = tmp.replace(QRegularExpression("\\s"), "_"); break;
+            }
+        }
+
+        for (int k = 0; k < m.capturedLength(3); k++) {
+            switch (m.capturedRef(3).at(k).toLatin1()) {
+            case '"':
+                tmp = tmp
+                    .replace("\"", "\\\"")
+                    .replace("\n", "\\n")
+                    .replace("\b", "\\b")
+                    .replace("\t", "\\t")
+                    .replace("\f", "\\f")
+                    .replace("\r", "\\r")
+                    .replace("\\", "\\\\");
+                break;
+            case '$':
+                tmp = tmp.replace("'", "'\"'\"'");
+                break;
+            case '%':
+                tmp = QUrl::toPercentEncoding(tmp);
+                break;
+            }
+        }
+
+        res += x.left(m.capturedStart());
+        res += tmp;
+        x = x.mid(m.capturedEnd());
+    }
+
+    return strdup(res.toUtf8().data());
+}
+
+// resolve only resolves the selection, since that's all the original supported.
+static const QString *resolve(void *ctx, nm_argtemplate_var_t var) {
+    if (var != NM_ARGTEMPLATE_VAR(selection))
+        NM_ERR_RET(NULL, "unexpected variable %d", var);
+    return reinterpret_cast<const QString*>(ctx);
+}
+
+static char *new_argtransform(QString const& selection, const char *arg) {
+    nm_argtemplate_t tmpl;
+    nm_argtemplate_parse(arg, &tmpl);
+    return nm_argtemplate_apply(&tmpl, resolve, const_cast<QString*>(&selection));
+}
+
+static const char *templates[] = {
+    "",
+    "no substitutions",
+    "{1||}",
+    "{1|aAfnsSuwx|\"$%}",
+    "/mnt/onboard/.adds/dict.sh '{1|S|$}'",
+    "https://duckduckgo.com/?q={1|S|%}",
+    "echo \"{1|s|\"}\" > /tmp/sel.txt",
+    "{1|f|} {1|n|} {1|w|} {1|x|} {1|a|} {1|A|}",
+    "{1|u|}",
+    "{1|nu|%}",
+    "{ {1 {1| {1|| {1|q|} {0||} {9||} {1||}} {{1|S|}",
+    "{1|S|$$%\"\"}",
+    "prefix {1|sS|\"} middle {1|x|$} suffix",
+};
+
+static const char *selections[] = {
+    "",
+    "word",
+    "  two\twords\n",
+    "\"quoted\" it's back\\slash\b\f\r",
+    "\xc3\xa9t\xc3\xa9 \xe2\x80\x94 na\xc3\xafve\xc2\xa0text \xf0\x9f\x93\x96",
+    "!@#$%^&*()",
+};
+
+// check compares the old and new implementations, and returns the number of
+// mismatches.
+static int check(QString const& selection, const char *arg, const char *desc) {
+    char *a = old_argtransform(selection, arg);
+    const char *a_err = a ? NULL : nm_err();
+    QByteArray a_err_s(a_err ? a_err : "");
+
+    char *b = new_argtransform(selection, arg);
+    const char *b_err = b ? NULL : nm_err();
+    QByteArray b_err_s(b_err ? b_err : "");
+
+    int fail = 0;
+    if (!a != !b || (a && strcmp(a, b)) || a_err_s != b_err_s) {
+        fprintf(stderr, "FAIL: template '%s' with %s:\n  old: %s%s\n  new: %s%s\n", arg, desc,
+            a ? a : "error: ", a ? "" : a_err_s.constData(),
+            b ? b : "error: ", b ? "" : b_err_s.constData());
+        fail = 1;
+    }
+    free(a);
+    free(b);
+    return fail;
+}
+
+// book returns n characters of text resembling a book, with punctuation,
+// quotes, non-ASCII characters and various whitespace.
+static QString book(int n) {
+    static const char *words[] = {
+        "the", "quick", "brown", "fox", "jumps", "over", "lazy", "dog,", "\"said\"", "it's",
+        "na\xc3\xafve", "caf\xc3\xa9", "\xe2\x80\x94", "end.\n\n", "(aside)", "\t", "r\xc3\xa9sum\xc3\xa9;",
+    };
+    QString s;
+    s.reserve(n + 32);
+    for (unsigned x = 1; s.size() < n;) {
+        x = x * 1103515245 + 12345;
+        s += QString::fromUtf8(words[(x >> 16) % (sizeof(words)/sizeof(*words))]);
+        s += QLatin1Char(' ');
+    }
+    s.truncate(n);
+    return s;
+}
+
+// bench returns the median time in ms to transform the selection using the
+// template.
+static double bench(char *(*fn)(QString const&, const char*), QString const& selection, const char *arg, int reps) {
+    QList<double> times;
+    for (int r = 0; r < reps; r++) {
+        QElapsedTimer t;
+        t.start();
+        free(fn(selection, arg));
+        times.append(t.nsecsElapsed() / 1e6);
+    }
+    std::sort(times.begin(), times.end());
+    return times.at(times.count() / 2);
+}
+
+static nm_argtemplate_t bench_tmpl;
+
+static char *new_parsed(QString const& selection, const char *) {
+    return nm_argtemplate_apply(&bench_tmpl, resolve, const_cast<QString*>(&selection));
+}
+
+int main() {
+    int fail = 0, n = 0;
+    for (const char *arg : templates) {
+        for (const char *sel : selections) {
+            fail += check(QString::fromUtf8(sel), arg, "a short selection");
+            n++;
+        }
+        fail += check(book(5000), arg, "a book-length selection");
+        n++;
+    }
+    printf("%d/%d checks passed\n\n", n - fail, n);
+
+    printf("%-48s %8s %12s %12s %12s %8s\n", "template", "chars", "old ms", "new ms", "parsed ms", "speedup");
+    const char *bench_templates[] = {
+        "/mnt/onboard/.adds/dict.sh '{1|S|$}'",
+        "https://duckduckgo.com/?q={1|S|%}",
+        "echo \"{1|s|\"}\" > /tmp/sel.txt",
+        "{1|f|} {1|n|} {1|w|} {1|x|}",
+        "prefix {1|sS|\"} middle {1|x|$} suffix",
+    };
+    for (const char *arg : bench_templates) {
+        nm_argtemplate_parse(arg, &bench_tmpl);
+        for (int chars : {100, 10000, 500000}) {
+            QString sel = book(chars);
+            int reps = chars > 100000 ? 5 : 51;
+            double o = bench(old_argtransform, sel, arg, reps);
+            double w = bench(new_argtransform, sel, arg, reps);
+            double p = bench(new_parsed, sel, arg, reps);
+            printf("%-48s %8d %12.3f %12.3f %12.3f %7.1fx\n", arg, chars, o, w, p, o / p);
+        }
+    }
+
+    return fail ? 1 : 0;
+}
@@ -0,0 +1,15 @@
+// Host stand-in for the parts of NickelHook used by kfmon.c and util.c.
+#ifndef NM_TEST_NICKELHOOK_H
+#define NM_TEST_NICKELHOOK_H
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// Only log if NM_TEST_VERBOSE is set, since the benchmarks would be dominated
+// by it otherwise.
+#define nh_log(fmt, ...) do {                                  \
+    if (getenv("NM_TEST_VERBOSE"))                             \
+        fprintf(stderr, "[nm] " fmt "\n", ##__VA_ARGS__);      \
+} while (0)
+
+#endif
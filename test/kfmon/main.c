@@ -0,0 +1,441 @@
+// Command kfmon-test exercises kfmon.c against a local stand-in for KFMon's
+// IPC socket, and optionally benchmarks it.
+//
+//     kfmon-test        run the tests
+//     kfmon-test bench  run the tests, then the benchmarks
+#define _GNU_SOURCE
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "action.h"
+#include "kfmon.h"
+#include "server.h"
+
+// kfmon.c only needs these to recognize the actions when batching chains.
+NM_ACTION_(kfmon)    { (void) arg; return NULL; }
+NM_ACTION_(kfmon_id) { (void) arg; return NULL; }
+
+static kfmon_server_t srv;
+static int failed = 0;
+
+#define CHECK(cond, fmt, ...) do {                                                 \
+    if (!(cond)) {                                                                 \
+        fprintf(stderr, "FAIL %s:%d: %s: " fmt "\n", __FILE__, __LINE__, #cond, ##__VA_ARGS__); \
+        failed++;                                                                  \
+    }                                                                              \
+} while (0)
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double*) a, y = *(const double*) b;
+    return (x > y) - (x < y);
+}
+
+// check_list verifies a list returned for the stand-in server's list of n watches.
+static void check_list(const kfmon_watch_list_t *list, size_t n, const char *what) {
+    CHECK(list->count == n, "%s: got %zu watches, expected %zu", what, list->count, n);
+    size_t i = 0;
+    for (; i < list->count; i++) {
+        const kfmon_watch_t *watch = &list->watches[i];
+        const char *w_filename = kfmon_watch_filename(list, watch), *w_label = kfmon_watch_label(list, watch);
+        char filename[64], label[64];
+        snprintf(filename, sizeof(filename), "watch%05zu.png", i);
+        if (i % 4 == 3)
+            snprintf(label, sizeof(label), "%s", filename);
+        else
+            snprintf(label, sizeof(label), "Watch %zu", i);
+        if (watch->idx != (uint8_t) i || strcmp(w_filename, filename) || strcmp(w_label, label)) {
+            CHECK(false, "%s: watch %zu is %u:%s:%s, expected %u:%s:%s", what, i, watch->idx, w_filename, w_label, (uint8_t) i, filename, label);
+            return;
+        }
+    }
+    CHECK(i == n, "%s: walked %zu watches, expected %zu", what, i, n);
+}
+
+static void test_simple(void) {
+    kfmon_server_configure(&srv, (kfmon_server_config_t){ 0 });
+
+    char last[256];
+    int status = nm_kfmon_simple_request("trigger", "foo.png");
+    kfmon_server_stats(&srv, NULL, NULL, last, sizeof(last));
+    CHECK(status == KFMON_IPC_OK, "status %d", status);
+    CHECK(!strcmp(last, "trigger:foo.png"), "server got '%s'", last);
+
+    status = nm_kfmon_simple_request("start", "3");
+    kfmon_server_stats(&srv, NULL, NULL, last, sizeof(last));
+    CHECK(status == KFMON_IPC_OK, "status %d", status);
+    CHECK(!strcmp(last, "start:3"), "server got '%s'", last);
+}
+
+static void test_replies(void) {
+    static const struct {
+        const char *reply;
+        int status;
+    } replies[] = {
+        {"OK",                       KFMON_IPC_OK},
+        {"ERR_INVALID_ID",           KFMON_IPC_ERR_INVALID_ID},
+        {"WARN_ALREADY_RUNNING",     KFMON_IPC_WARN_ALREADY_RUNNING},
+        {"WARN_SPAWN_BLOCKED",       KFMON_IPC_WARN_SPAWN_BLOCKED},
+        {"WARN_SPAWN_INHIBITED",     KFMON_IPC_WARN_SPAWN_INHIBITED},
+        {"ERR_REALLY_MALFORMED_CMD", KFMON_IPC_ERR_REALLY_MALFORMED_CMD},
+        {"ERR_MALFORMED_CMD",        KFMON_IPC_ERR_MALFORMED_CMD},
+        {"ERR_INVALID_CMD",          KFMON_IPC_ERR_INVALID_CMD},
+        {"WHAT",                     KFMON_IPC_UNKNOWN_REPLY},
+    };
+    for (size_t i = 0; i < sizeof(replies)/sizeof(*replies); i++) {
+        kfmon_server_configure(&srv, (kfmon_server_config_t){ .reply = replies[i].reply });
+        int status = nm_kfmon_simple_request("trigger", "foo.png");
+        CHECK(status == replies[i].status, "reply %s: status %d, expected %d", replies[i].reply, status, replies[i].status);
+    }
+
+    // the session should survive error replies from KFMon itself (but not
+    // unknown ones, so get it going again first)
+    kfmon_server_configure(&srv, (kfmon_server_config_t){ .reply = "WARN_ALREADY_RUNNING" });
+    nm_kfmon_simple_request("trigger", "foo.png");
+    kfmon_server_configure(&srv, (kfmon_server_config_t){ .reply = "WARN_ALREADY_RUNNING" });
+    for (int i = 0; i < 5; i++)
+        nm_kfmon_simple_request("trigger", "foo.png");
+    size_t conns;
+    kfmon_server_stats(&srv, &conns, NULL, NULL, 0);
+    CHECK(conns == 0, "reconnected %zu times after warnings", conns);
+}
+
+static void test_session(void) {
+    // requests should reuse the connection
+    kfmon_server_configure(&srv, (kfmon_server_config_t){ 0 });
+    for (int i = 0; i < 20; i++)
+        CHECK(nm_kfmon_simple_request("trigger", "foo.png") == KFMON_IPC_OK, "request %d", i);
+    size_t conns, cmds;
+    kfmon_server_stats(&srv, &conns, &cmds, NULL, 0);
+    CHECK(conns <= 1, "%zu connections for 20 requests", conns);
+    CHECK(cmds == 20, "server got %zu commands", cmds);
+
+    // and reconnect transparently if KFMon hangs up
+    kfmon_server_configure(&srv, (kfmon_server_config_t){ .hangup = 1 });
+    for (int i = 0; i < 5; i++)
+        CHECK(nm_kfmon_simple_request("trigger", "foo.png") == KFMON_IPC_OK, "request %d after hangup", i);
+    kfmon_server_stats(&srv, &conns, &cmds, NULL, 0);
+    CHECK(cmds == 5, "server got %zu commands, expected each to be sent once", cmds);
+    CHECK(conns >= 4, "only %zu connections with hangups", conns);
+
+    // and give up if it doesn't reply
+    kfmon_server_configure(&srv, (kfmon_server_config_t){ .mute = true });
+    double t = now_ms();
+    int status = nm_kfmon_simple_request("trigger", "foo.png");
+    t = now_ms() - t;
+    CHECK(status == KFMON_IPC_ETIMEDOUT, "status %d", status);
+    CHECK(t >= KFMON_IPC_TIMEOUT_MS - 5 && t < KFMON_IPC_TIMEOUT_MS * 2, "timed out after %.0f ms", t);
+
+    // but recover afterwards (and not get confused by a late reply)
+    kfmon_server_configure(&srv, (kfmon_server_config_t){ .reply = "WARN_SPAWN_BLOCKED", .latency_ms = KFMON_IPC_TIMEOUT_MS + 50 });
+    status = nm_kfmon_simple_request("trigger", "foo.png");
+    CHECK(status == KFMON_IPC_ETIMEDOUT, "status %d", status);
+    kfmon_server_configure(&srv, (kfmon_server_config_t){ 0 });
+    status = nm_kfmon_simple_request("trigger", "foo.png");
+    CHECK(status == KFMON_IPC_OK, "status %d after timeouts", status);
+}
+
+static void test_list(void) {
+    static const size_t sizes[] = {0, 1, 2, 100, 1000, 5000};
+    static const size_t frags[] = {0, 1, 7, 100, 4096};
+    for (size_t i = 0; i < sizeof(sizes)/sizeof(*sizes); i++) {
+        for (size_t j = 0; j < sizeof(frags)/sizeof(*frags); j++) {
+            if (sizes[i] > 100 && frags[j] == 1)
+                continue; // too slow to be useful
+            kfmon_server_configure(&srv, (kfmon_server_config_t){ .list_n = sizes[i], .frag = frags[j] });
+
+            char what[64];
+            snprintf(what, sizeof(what), "list of %zu in chunks of <=%zu", sizes[i], frags[j]);
+
+            kfmon_watch_list_t list = { 0 };
+            int status = nm_kfmon_list_request("gui-list", &list);
+            CHECK(status == KFMON_IPC_OK, "%s: status %d", what, status);
+            check_list(&list, sizes[i], what);
+            kfmon_teardown_list(&list);
+        }
+    }
+
+    // error replies to a list (the server only lists for list and gui-list)
+    kfmon_server_configure(&srv, (kfmon_server_config_t){ .reply = "ERR_INVALID_CMD" });
+    kfmon_watch_list_t list = { 0 };
+    int status = nm_kfmon_list_request("bogus-list", &list);
+    CHECK(status == KFMON_IPC_ERR_INVALID_CMD, "status %d", status);
+    kfmon_server_configure(&srv, (kfmon_server_config_t){ .reply = "OK" });
+    status = nm_kfmon_list_request("bogus-list", &list);
+    CHECK(status == KFMON_IPC_UNKNOWN_REPLY, "status %d", status);
+    CHECK(list.count == 0, "got %zu watches", list.count);
+    kfmon_teardown_list(&list);
+
+    // and list replies to a simple request
+    kfmon_server_configure(&srv, (kfmon_server_config_t){ .list_n = 3 });
+    status = nm_kfmon_simple_request("list", NULL);
+    CHECK(status == KFMON_IPC_UNKNOWN_REPLY, "status %d", status);
+}
+
+static void test_batch(void) {
+    kfmon_server_configure(&srv, (kfmon_server_config_t){ .frag = 3 });
+    kfmon_batch_request_t reqs[] = {
+        {"trigger", "a.png", -1},
+        {"start",   "1",     -1},
+        {"trigger", "b.png", -1},
+    };
+    nm_kfmon_batch_request(reqs, 3);
+    for (size_t i = 0; i < 3; i++)
+        CHECK(reqs[i].status == KFMON_IPC_OK, "batch request %zu: status %d", i, reqs[i].status);
+    size_t cmds;
+    char last[256];
+    kfmon_server_stats(&srv, NULL, &cmds, last, sizeof(last));
+    CHECK(cmds == 3, "server got %zu commands", cmds);
+    CHECK(!strcmp(last, "trigger:b.png"), "server got '%s' last", last);
+}
+
+static nm_action_result_t *other_act(const char *arg) { (void) arg; return NULL; }
+
+// test_batch_chain runs a chain with several kfmon segments like nm_menu_item_run,
+// where the requests are sent synchronously instead of from the event loop.
+static void test_batch_chain(void) {
+    kfmon_server_configure(&srv, (kfmon_server_config_t){ 0 });
+    nm_menu_action_t acts[] = {
+        { .arg = (char*) "a.png", .on_success = true,                     .act = NM_ACTION(kfmon)    },
+        { .arg = (char*) "x",     .on_success = true,                     .act = other_act           },
+        { .arg = (char*) "b.png", .on_success = true,                     .act = NM_ACTION(kfmon)    },
+        { .arg = (char*) "1",     .on_success = true, .on_failure = true, .act = NM_ACTION(kfmon_id) },
+        { .arg = (char*) "y",     .on_success = true, .on_failure = true, .act = other_act           },
+        { .arg = (char*) "z",     .on_success = true, .on_failure = true, .act = other_act           },
+        { .arg = (char*) "c.png", .on_success = true,                     .act = NM_ACTION(kfmon)    },
+    };
+    size_t acts_n = sizeof(acts)/sizeof(*acts);
+    for (size_t i = 0; i + 1 < acts_n; i++)
+        acts[i].next = &acts[i+1];
+
+    kfmon_batch_t batch = { 0 };
+    size_t sizes[8], sizes_n = 0, used = 0;
+    for (nm_menu_action_t *cur = acts; cur; cur = cur->next) {
+        size_t n = nm_kfmon_batch_start(&batch, cur);
+        if (n) {
+            sizes[sizes_n++] = n;
+            nm_kfmon_batch_request(batch.reqs, n);
+            CHECK(!nm_kfmon_batch_start(&batch, cur), "batch started again when resuming at action %zu", (size_t)(cur - acts));
+        }
+        int status;
+        if (nm_kfmon_batch_next(&batch, &status)) {
+            CHECK(cur->act != other_act, "action %zu used a kfmon result", (size_t)(cur - acts));
+            CHECK(status == KFMON_IPC_OK, "action %zu: status %d", (size_t)(cur - acts), status);
+            used++;
+        } else {
+            CHECK(cur->act == other_act, "kfmon action %zu wasn't batched", (size_t)(cur - acts));
+        }
+    }
+    CHECK(sizes_n == 3 && sizes[0] == 1 && sizes[1] == 2 && sizes[2] == 1, "got %zu batches", sizes_n);
+    CHECK(used == 4, "used %zu kfmon results", used);
+}
+
+static int async_done;
+
+static void async_cb(void *ctx) {
+    (void) ctx;
+    async_done++;
+}
+
+static void test_async(void) {
+    kfmon_server_configure(&srv, (kfmon_server_config_t){ .list_n = 500, .frag = 512, .latency_ms = 20 });
+
+    async_done = 0;
+    kfmon_batch_request_t reqs[] = {
+        {"trigger", "a.png", -1},
+        {"trigger", "b.png", -1},
+    };
+    kfmon_watch_list_t list = { 0 };
+    int list_status = -1;
+
+    nm_kfmon_async_batch_request(reqs, 2, async_cb, NULL);
+    nm_kfmon_async_list_request("list", &list, &list_status, async_cb, NULL);
+
+    // nothing should have blocked yet
+    int timeout, fd;
+    size_t steps = 0;
+    while ((fd = nm_kfmon_async_step(&timeout)) != -1) {
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        poll(&pfd, 1, timeout);
+        steps++;
+    }
+    CHECK(async_done == 2, "%d callbacks", async_done);
+    CHECK(reqs[0].status == KFMON_IPC_OK && reqs[1].status == KFMON_IPC_OK, "statuses %d %d", reqs[0].status, reqs[1].status);
+    CHECK(list_status == KFMON_IPC_OK, "list status %d", list_status);
+    check_list(&list, 500, "async list");
+    CHECK(steps >= 3, "only %zu steps", steps);
+    kfmon_teardown_list(&list);
+}
+
+static int notified;
+
+static void notify_cb(void *ctx) {
+    (void) ctx;
+    notified++;
+}
+
+// async_wait makes progress on the session until cond is true, or up to ms.
+#define async_wait(cond, ms) do {                                   \
+    double _end = now_ms() + (ms);                                  \
+    while (!(cond) && now_ms() < _end) {                            \
+        int _timeout, _fd = nm_kfmon_async_step(&_timeout);         \
+        struct pollfd _pfd = { .fd = _fd, .events = POLLIN };       \
+        poll(&_pfd, _fd == -1 ? 0 : 1, 10);                         \
+    }                                                               \
+} while (0)
+
+static void test_subscribe(void) {
+    // subscribing should happen by itself, and keep the session open
+    kfmon_server_configure(&srv, (kfmon_server_config_t){ .subscribe = true, .frag = 4 });
+    notified = 0;
+    nm_kfmon_async_subscribe(notify_cb, NULL);
+    async_wait(nm_kfmon_subscribed(), 1000);
+    CHECK(nm_kfmon_subscribed(), "not subscribed");
+    char last[256];
+    kfmon_server_stats(&srv, NULL, NULL, last, sizeof(last));
+    CHECK(!strcmp(last, "subscribe"), "server got '%s' last", last);
+
+    // notifications should be passed on while idle
+    kfmon_server_notify(&srv);
+    async_wait(notified == 1, 1000);
+    CHECK(notified == 1, "%d notifications while idle", notified);
+
+    // and shouldn't get mixed up with replies
+    kfmon_server_configure(&srv, (kfmon_server_config_t){ .subscribe = true, .frag = 4, .list_n = 50, .latency_ms = 20 });
+    for (int i = 0; i < 5; i++) {
+        kfmon_server_notify(&srv);
+        int status = nm_kfmon_simple_request("trigger", "foo.png");
+        CHECK(status == KFMON_IPC_OK, "request %d with notifications: status %d", i, status);
+        kfmon_watch_list_t list = { 0 };
+        kfmon_server_notify(&srv);
+        status = nm_kfmon_list_request("list", &list);
+        CHECK(status == KFMON_IPC_OK, "list %d with notifications: status %d", i, status);
+        check_list(&list, 50, "list with notifications");
+        kfmon_teardown_list(&list);
+    }
+    async_wait(notified == 11, 1000);
+    CHECK(notified == 11, "%d notifications with requests", notified);
+    size_t conns;
+    kfmon_server_stats(&srv, &conns, NULL, NULL, 0);
+    CHECK(conns == 0, "reconnected %zu times with notifications", conns);
+
+    // it should be renewed after a reconnect
+    kfmon_server_configure(&srv, (kfmon_server_config_t){ .subscribe = true, .hangup = 1 });
+    nm_kfmon_simple_request("trigger", "foo.png");
+    kfmon_server_configure(&srv, (kfmon_server_config_t){ .subscribe = true });
+    nm_kfmon_simple_request("trigger", "foo.png");
+    async_wait(nm_kfmon_subscribed(), 1000);
+    CHECK(nm_kfmon_subscribed(), "not subscribed after reconnecting");
+
+    // but fall back gracefully if it's not supported
+    kfmon_server_configure(&srv, (kfmon_server_config_t){ .hangup = 1 });
+    nm_kfmon_simple_request("trigger", "foo.png");
+    kfmon_server_configure(&srv, (kfmon_server_config_t){ 0 });
+    CHECK(nm_kfmon_simple_request("trigger", "foo.png") == KFMON_IPC_OK, "request without subscription support");
+    async_wait(false, 50);
+    CHECK(!nm_kfmon_subscribed(), "subscribed without support");
+    size_t cmds;
+    kfmon_server_stats(&srv, &conns, &cmds, NULL, 0);
+    CHECK(conns == 1 && cmds == 2, "%zu connections and %zu commands without subscription support", conns, cmds);
+
+    nm_kfmon_async_subscribe(NULL, NULL);
+}
+
+static void test_down(void) {
+    kfmon_server_stop(&srv);
+    int status = nm_kfmon_simple_request("trigger", "foo.png");
+    CHECK(status == KFMON_IPC_CONNECT_FAILURE, "status %d with KFMon down", status);
+}
+
+// bench_simple measures the latency of n simple requests.
+static void bench_simple(const char *name, kfmon_server_config_t cfg, size_t n) {
+    kfmon_server_configure(&srv, cfg);
+    nm_kfmon_simple_request("trigger", "warmup.png");
+
+    double *lat = calloc(n, sizeof(double));
+    double start = now_ms();
+    for (size_t i = 0; i < n; i++) {
+        double t = now_ms();
+        if (nm_kfmon_simple_request("trigger", "foo.png") != KFMON_IPC_OK) {
+            CHECK(false, "%s: request %zu failed", name, i);
+            break;
+        }
+        lat[i] = now_ms() - t;
+    }
+    double total = now_ms() - start;
+
+    qsort(lat, n, sizeof(double), cmp_double);
+    printf("%-32s %8zu %10.1f %10.3f %10.3f %10.3f\n", name, n, n / (total / 1e3), total / n, lat[n / 2], lat[n * 99 / 100]);
+    free(lat);
+}
+
+// bench_list measures the cost of listing n watches.
+static void bench_list(size_t n, size_t frag, size_t reps) {
+    kfmon_server_configure(&srv, (kfmon_server_config_t){ .list_n = n, .frag = frag });
+
+    double *lat = calloc(reps, sizeof(double));
+    for (size_t i = 0; i < reps; i++) {
+        kfmon_watch_list_t list = { 0 };
+        double t = now_ms();
+        int status = nm_kfmon_list_request("list", &list);
+        lat[i] = now_ms() - t;
+        CHECK(status == KFMON_IPC_OK && list.count == n, "list of %zu: status %d, count %zu", n, status, list.count);
+        kfmon_teardown_list(&list);
+    }
+
+    qsort(lat, reps, sizeof(double), cmp_double);
+    double med = lat[reps / 2];
+    printf("%8zu %8zu %8zu %10.3f %10.3f %12.3f\n", n, frag, reps, med, lat[reps * 99 / 100], n ? med * 1e3 / n : 0);
+    free(lat);
+}
+
+static void bench(void) {
+    printf("\n%-32s %8s %10s %10s %10s %10s\n", "simple requests", "n", "req/s", "mean ms", "p50 ms", "p99 ms");
+    bench_simple("persistent session",             (kfmon_server_config_t){ 0 },                         5000);
+    bench_simple("reconnect every request",        (kfmon_server_config_t){ .hangup = 1 },               2000);
+    bench_simple("fragmented replies",             (kfmon_server_config_t){ .frag = 1 },                 2000);
+    bench_simple("1ms server latency",             (kfmon_server_config_t){ .latency_ms = 1 },           500);
+
+    printf("\n%8s %8s %8s %10s %10s %12s\n", "watches", "chunk", "reps", "p50 ms", "p99 ms", "us/watch");
+    bench_list(10,   0,    500);
+    bench_list(100,  0,    500);
+    bench_list(1000, 0,    100);
+    bench_list(5000, 0,    50);
+    bench_list(5000, 4096, 50);
+    bench_list(5000, 512,  20);
+}
+
+int main(int argc, char **argv) {
+    if (!kfmon_server_start(&srv, KFMON_IPC_SOCKET, (kfmon_server_config_t){ 0 }))
+        return 2;
+
+    test_simple();
+    test_replies();
+    test_session();
+    test_list();
+    test_batch();
+    test_batch_chain();
+    test_async();
+    test_subscribe();
+
+    if (argc > 1 && !strcmp(argv[1], "bench"))
+        bench();
+
+    test_down();
+
+    if (failed) {
+        fprintf(stderr, "%d checks failed\n", failed);
+        return 1;
+    }
+    printf("\nall checks passed\n");
+    return 0;
+}
@@ -0,0 +1,227 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "server.h"
+
+static void kfmon_server_sleep(int ms) {
+    struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+    while (nanosleep(&ts, &ts) == -1 && errno == EINTR);
+}
+
+// Send a reply, possibly split into chunks at arbitrary boundaries. Returns false if the client went away.
+static bool kfmon_server_send(int fd, const char *buf, size_t len, size_t frag, unsigned *seed) {
+    size_t pos = 0;
+    while (pos < len) {
+        size_t n = len - pos;
+        if (frag && n > 1) {
+            size_t max = frag < n ? frag : n;
+            n = 1 + (size_t) rand_r(seed) % max;
+        }
+        ssize_t w = send(fd, buf + pos, n, MSG_NOSIGNAL);
+        if (w < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        pos += (size_t) w;
+        if (frag) {
+            // give the client a chance to read each chunk separately
+            sched_yield();
+        }
+    }
+    return true;
+}
+
+// Build a list reply like KFMon's (id:filename:label records, terminated by a NUL).
+static char *kfmon_server_list(size_t n, size_t *len_out) {
+    size_t cap = 64 + n * 48, len = 0;
+    char *buf = malloc(cap);
+    for (size_t i = 0; i < n; i++) {
+        // every fourth watch doesn't have a label, like KFMon's watches without one
+        len += (size_t) (i % 4 == 3
+            ? snprintf(buf + len, cap - len, "%zu:watch%05zu.png\n", i, i)
+            : snprintf(buf + len, cap - len, "%zu:watch%05zu.png:Watch %zu\n", i, i, i));
+    }
+    buf[len++] = '\0';
+    *len_out = len;
+    return buf;
+}
+
+// Handle a single client until it disconnects (or we hang up on it).
+static void kfmon_server_client(kfmon_server_t *s, int fd) {
+    unsigned seed = 1;
+    int cmds = 0;
+    bool subscribed = false;
+    char buf[256];
+
+    while (1) {
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        int r = poll(&pfd, 1, 10);
+        pthread_mutex_lock(&s->lock);
+        bool stop = s->stop;
+        size_t notify = subscribed ? s->notify : 0;
+        s->notify = 0;
+        kfmon_server_config_t cfg = s->cfg;
+        pthread_mutex_unlock(&s->lock);
+        if (stop) {
+            break;
+        }
+        for (; notify; notify--) {
+            static const char msg[] = "NOTIFY_LIST_CHANGED";
+            if (!kfmon_server_send(fd, msg, sizeof(msg), cfg.frag, &seed)) {
+                close(fd);
+                return;
+            }
+        }
+        if (r <= 0) {
+            continue;
+        }
+
+        // NOTE: like KFMon, a single read is a single command
+        ssize_t len = recv(fd, buf, sizeof(buf) - 1, 0);
+        if (len <= 0) {
+            break;
+        }
+        buf[len] = '\0';
+
+        pthread_mutex_lock(&s->lock);
+        cfg = s->cfg;
+        s->cmds++;
+        snprintf(s->last, sizeof(s->last), "%s", buf);
+        pthread_mutex_unlock(&s->lock);
+        cmds++;
+
+        if (cfg.latency_ms) {
+            kfmon_server_sleep(cfg.latency_ms);
+        }
+
+        if (!cfg.mute) {
+            bool ok;
+            if (!strcmp(buf, "subscribe")) {
+                subscribed = cfg.subscribe;
+                const char *reply = cfg.subscribe ? "OK" : "ERR_INVALID_CMD";
+                ok = kfmon_server_send(fd, reply, strlen(reply) + 1, cfg.frag, &seed);
+            } else if (!strcmp(buf, "list") || !strcmp(buf, "gui-list")) {
+                size_t n;
+                char *list = kfmon_server_list(cfg.list_n, &n);
+                ok = kfmon_server_send(fd, list, n, cfg.frag, &seed);
+                free(list);
+            } else {
+                const char *reply = cfg.reply ? cfg.reply : "OK";
+                ok = kfmon_server_send(fd, reply, strlen(reply) + 1, cfg.frag, &seed);
+            }
+            if (!ok) {
+                break;
+            }
+        }
+
+        if (cfg.hangup && cmds >= cfg.hangup) {
+            break;
+        }
+    }
+    close(fd);
+}
+
+static void *kfmon_server_run(void *arg) {
+    kfmon_server_t *s = arg;
+    while (1) {
+        pthread_mutex_lock(&s->lock);
+        bool stop = s->stop;
+        pthread_mutex_unlock(&s->lock);
+        if (stop) {
+            break;
+        }
+
+        struct pollfd pfd = { .fd = s->listen_fd, .events = POLLIN };
+        if (poll(&pfd, 1, 100) <= 0) {
+            continue;
+        }
+
+        int fd = accept4(s->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd == -1) {
+            continue;
+        }
+
+        pthread_mutex_lock(&s->lock);
+        s->conns++;
+        pthread_mutex_unlock(&s->lock);
+
+        kfmon_server_client(s, fd);
+    }
+    return NULL;
+}
+
+bool kfmon_server_start(kfmon_server_t *s, const char *path, kfmon_server_config_t cfg) {
+    memset(s, 0, sizeof(*s));
+    s->path = path;
+    s->cfg  = cfg;
+    pthread_mutex_init(&s->lock, NULL);
+
+    if ((s->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1) {
+        perror("socket");
+        return false;
+    }
+
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    unlink(path);
+
+    if (bind(s->listen_fd, (struct sockaddr*) &addr, sizeof(addr)) == -1 || listen(s->listen_fd, 8) == -1) {
+        perror("bind/listen");
+        close(s->listen_fd);
+        return false;
+    }
+
+    if (pthread_create(&s->thread, NULL, kfmon_server_run, s)) {
+        perror("pthread_create");
+        close(s->listen_fd);
+        return false;
+    }
+    return true;
+}
+
+void kfmon_server_configure(kfmon_server_t *s, kfmon_server_config_t cfg) {
+    pthread_mutex_lock(&s->lock);
+    s->cfg   = cfg;
+    s->conns = 0;
+    s->cmds  = 0;
+    s->last[0] = '\0';
+    pthread_mutex_unlock(&s->lock);
+}
+
+void kfmon_server_stats(kfmon_server_t *s, size_t *conns_out, size_t *cmds_out, char *last_out, size_t last_sz) {
+    pthread_mutex_lock(&s->lock);
+    if (conns_out)
+        *conns_out = s->conns;
+    if (cmds_out)
+        *cmds_out = s->cmds;
+    if (last_out)
+        snprintf(last_out, last_sz, "%s", s->last);
+    pthread_mutex_unlock(&s->lock);
+}
+
+void kfmon_server_notify(kfmon_server_t *s) {
+    pthread_mutex_lock(&s->lock);
+    s->notify++;
+    pthread_mutex_unlock(&s->lock);
+}
+
+void kfmon_server_stop(kfmon_server_t *s) {
+    pthread_mutex_lock(&s->lock);
+    s->stop = true;
+    pthread_mutex_unlock(&s->lock);
+    pthread_join(s->thread, NULL);
+    close(s->listen_fd);
+    unlink(s->path);
+}
@@ -0,0 +1,52 @@
+#ifndef NM_TEST_KFMON_SERVER_H
+#define NM_TEST_KFMON_SERVER_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// The behaviour of the stand-in server. It can be changed at any time (with
+// kfmon_server_configure) and takes effect for the next command.
+typedef struct {
+    int         latency_ms; // delay before replying to each command
+    size_t      frag;       // if nonzero, split each reply into chunks of 1-frag bytes
+    size_t      list_n;     // number of watches in list replies
+    const char *reply;      // reply to non-list commands (e.g. OK, ERR_INVALID_ID, WARN_ALREADY_RUNNING)
+    int         hangup;     // if nonzero, hang up after this many commands on a connection
+    bool        mute;       // if true, never reply (but keep the connection open)
+    bool        subscribe;  // if true, support the subscribe command (otherwise, it's an invalid one like on older KFMon builds)
+} kfmon_server_config_t;
+
+typedef struct {
+    const char            *path;
+    pthread_t             thread;
+    pthread_mutex_t       lock;
+    kfmon_server_config_t cfg;
+    int                   listen_fd;
+    bool                  stop;
+    size_t                conns; // number of accepted connections
+    size_t                cmds;  // number of received commands
+    char                  last[256]; // last received command
+    size_t                notify;    // number of notifications to send
+} kfmon_server_t;
+
+// kfmon_server_start starts a server which mimics KFMon's IPC protocol on
+// path (which is replaced if it exists) in a background thread. Like KFMon,
+// it only handles a single client at a time. Returns false on error.
+bool kfmon_server_start(kfmon_server_t *s, const char *path, kfmon_server_config_t cfg);
+
+// kfmon_server_configure changes the server's behaviour and resets the stats.
+void kfmon_server_configure(kfmon_server_t *s, kfmon_server_config_t cfg);
+
+// kfmon_server_stats gets the number of connections and commands since the
+// server was last configured, and optionally the last command.
+void kfmon_server_stats(kfmon_server_t *s, size_t *conns_out, size_t *cmds_out, char *last_out, size_t last_sz);
+
+// kfmon_server_notify sends a list change notification to the current client
+// if it's subscribed (as soon as it's done replying to the current command).
+void kfmon_server_notify(kfmon_server_t *s);
+
+// kfmon_server_stop stops the server and removes the socket.
+void kfmon_server_stop(kfmon_server_t *s);
+
+#endif
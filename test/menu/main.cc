@@ -0,0 +1,116 @@
+// Compares the ways of injecting items into a menu which _nm_menu_inject has
+// used, with stand-ins for Nickel's createMenuTextItem and createAction.
+
+#include <QAction>
+#include <QApplication>
+#include <QElapsedTimer>
+#include <QLabel>
+#include <QList>
+#include <QMenu>
+#include <QString>
+#include <QWidgetAction>
+
+#include <algorithm>
+
+#include <stdio.h>
+
+// like AbstractNickelMenuController::createMenuTextItem
+static QWidget *create_menu_text_item(QMenu *menu, QString const& text) {
+    return new QLabel(text, menu);
+}
+
+// like AbstractNickelMenuController::createAction (see the comment in
+// nickelmenu.cc)
+static QAction *create_action(QMenu *menu, QWidget *widget, bool enabled) {
+    QWidgetAction *act = new QWidgetAction(menu);
+    act->setDefaultWidget(widget);
+    act->setEnabled(enabled);
+    menu->addAction(act);
+    return act;
+}
+
+// inject_each adds each item to the end of the menu, then moves it before the
+// anchor and inserts a separator after it (like before).
+static void inject_each(QMenu *menu, QAction *before, int k) {
+    for (int i = 0; i < k; i++) {
+        int n = menu->actions().count();
+        QAction *action = create_action(menu, create_menu_text_item(menu, QString("Item %1").arg(i)), true);
+        if (!menu->actions().contains(action)) {
+            fprintf(stderr, "action not added (%d)\n", n);
+            return;
+        }
+        menu->removeAction(action);
+        menu->insertAction(before, action);
+        menu->insertSeparator(before);
+    }
+}
+
+// inject_batch creates the items detached from the menu, then inserts all of
+// them at once (like now).
+static void inject_batch(QMenu *menu, QAction *before, int k) {
+    static QMenu *scratch = new QMenu();
+
+    QList<QAction*> batch;
+    batch.reserve(k * 2);
+    for (int i = 0; i < k; i++) {
+        QAction *action = create_action(scratch, create_menu_text_item(menu, QString("Item %1").arg(i)), true);
+        scratch->removeAction(action);
+        QAction *sep = new QAction(menu);
+        sep->setSeparator(true);
+        batch.append(action);
+        batch.append(sep);
+    }
+
+    menu->setUpdatesEnabled(false);
+    menu->insertActions(before, batch);
+    menu->setUpdatesEnabled(true);
+}
+
+// bench runs inject on a new menu with n native items (injecting before the
+// one in the middle), and returns the median time in ms.
+static double bench(void (*inject)(QMenu*, QAction*, int), int n, int k, bool visible, int reps) {
+    QList<double> times;
+    for (int r = 0; r < reps; r++) {
+        QMenu menu;
+        QAction *before = nullptr;
+        for (int i = 0; i < n; i++) {
+            QAction *action = create_action(&menu, create_menu_text_item(&menu, QString("Native %1").arg(i)), true);
+            if (i == n / 2)
+                before = action;
+        }
+        if (visible) {
+            menu.show();
+            QApplication::processEvents();
+        }
+
+        QElapsedTimer t;
+        t.start();
+        inject(&menu, before, k);
+        if (visible)
+            QApplication::processEvents(); // include the relayout
+        times.append(t.nsecsElapsed() / 1e6);
+
+        if (menu.actions().count() != n + k * 2)
+            fprintf(stderr, "wrong number of actions: %d, expected %d\n", menu.actions().count(), n + k * 2);
+        if (menu.actions().at(n / 2 + k * 2) != before)
+            fprintf(stderr, "items not inserted before the anchor\n");
+    }
+    std::sort(times.begin(), times.end());
+    return times.at(times.count() / 2);
+}
+
+int main(int argc, char **argv) {
+    QApplication app(argc, argv);
+
+    printf("%8s %8s %8s %12s %12s %8s\n", "native", "injected", "visible", "each ms", "batch ms", "speedup");
+    const int sizes[][2] = {{10, 10}, {50, 40}, {200, 40}, {500, 100}, {2000, 200}, {2000, 1000}};
+    for (bool visible : {false, true}) {
+        for (auto size : sizes) {
+            int reps = size[0] * size[1] > 100000 ? 3 : 11;
+            double each  = bench(inject_each,  size[0], size[1], visible, reps);
+            double batch = bench(inject_batch, size[0], size[1], visible, reps);
+            printf("%8d %8d %8s %12.3f %12.3f %7.1fx\n", size[0], size[1], visible ? "yes" : "no", each, batch, each / batch);
+        }
+    }
+    return 0;
+}